@@ -9,6 +9,7 @@ void addAlias(char **arguments) {
 
     if (aliasCommand == NULL) {
         printf("Not enough arguments for alias\n");
+        lastExitStatus = 1;
         return;
     }
     char wholeCommand[MAX_INPUT_SIZE] = {'\0'};
@@ -46,6 +47,7 @@ void addAlias(char **arguments) {
         }
     }
     printf("No more space for aliases\n");
+    lastExitStatus = 1;
 
 }
 
@@ -57,11 +59,13 @@ void removeAlias(char **arguments) {
 
     if (aliasName == NULL) {
         printf("Not enough arguments for unalias\n");
+        lastExitStatus = 1;
         return;
     }
 
     if (arguments[2] != NULL) {
         printf("Too many arguments for unalias\n");
+        lastExitStatus = 1;
         return;
     }
 
@@ -74,6 +78,7 @@ void removeAlias(char **arguments) {
          }
     }
     printf("Alias not found %s\n", arguments[1]);
+    lastExitStatus = 1;
 }
 
 /*
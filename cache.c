@@ -0,0 +1,542 @@
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "cache.h"
+#include "limit.h"
+#include "trace.h"
+
+static long long cacheSizeCap = -1;
+
+/*
+ *  Handles the cache builtin
+ *  cache                                  prints the cache statistics
+ *  cache -c                               clears the cache
+ *  cache -s <size>                        sets the size cap (K, M and G suffixes allowed)
+ *  cache [-f file]... [-e VAR]... command runs command, replaying its output if cached
+ */
+void cacheCommand(char **arguments) {
+    char *inputFiles[MAX_CACHE_INPUTS];
+    char *envNames[MAX_CACHE_INPUTS];
+    int inputFileCount = 0;
+    int envNameCount = 0;
+
+    if (arguments[1] == NULL) {
+        printCacheStats();
+        return;
+    }
+    if (strcmp(arguments[1], "-c") == 0) {
+        if (arguments[2] != NULL) {
+            printf("Too many arguments for cache -c\n");
+            lastExitStatus = 1;
+            return;
+        }
+        clearCache();
+        return;
+    }
+    if (strcmp(arguments[1], "-s") == 0) {
+        if (arguments[2] == NULL || arguments[3] != NULL) {
+            printf("cache -s requires exactly one size\n");
+            lastExitStatus = 1;
+            return;
+        }
+        long long size = parseSize(arguments[2]);
+        if (size <= 0) {
+            printf("Invalid cache size %s\n", arguments[2]);
+            lastExitStatus = 1;
+            return;
+        }
+        cacheSizeCap = size;
+        printf("Cache size cap: %lld bytes\n", cacheSizeCap);
+        evictCacheEntries();
+        return;
+    }
+
+    //Collect the options describing what the output depends on
+    int i = 1;
+    while (arguments[i] != NULL && (strcmp(arguments[i], "-f") == 0 || strcmp(arguments[i], "-e") == 0)) {
+        if (arguments[i + 1] == NULL) {
+            printf("Missing value for cache %s\n", arguments[i]);
+            lastExitStatus = 1;
+            return;
+        }
+        if (arguments[i][1] == 'f') {
+            if (inputFileCount >= MAX_CACHE_INPUTS) {
+                printf("Too many input files for cache\n");
+                lastExitStatus = 1;
+                return;
+            }
+            inputFiles[inputFileCount++] = arguments[i + 1];
+        } else {
+            if (envNameCount >= MAX_CACHE_INPUTS) {
+                printf("Too many environment variables for cache\n");
+                lastExitStatus = 1;
+                return;
+            }
+            envNames[envNameCount++] = arguments[i + 1];
+        }
+        i += 2;
+    }
+    if (arguments[i] == NULL) {
+        printf("cache requires a command to run\n");
+        lastExitStatus = 1;
+        return;
+    }
+    runCached(arguments + i, inputFiles, inputFileCount, envNames, envNameCount);
+}
+
+/*
+ *  Returns the size cap, reading it from the environment the first time
+ */
+static long long getCacheSizeCap() {
+    if (cacheSizeCap < 0) {
+        char *configured = getenv(CACHE_SIZE_ENV);
+        cacheSizeCap = DEFAULT_CACHE_SIZE;
+        if (configured != NULL && parseSize(configured) > 0) {
+            cacheSizeCap = parseSize(configured);
+        }
+    }
+    return cacheSizeCap;
+}
+
+/*
+ *  Writes the whole buffer to fd, retrying on short writes
+ */
+static void writeAll(int fd, char *buffer, long long length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+/*
+ *  Reads what is available on fd, echoing it to echoFd and appending it to buffer
+ *  Returns false once fd reaches end of file
+ */
+static bool captureOutput(int fd, int echoFd, char **buffer, long long *length) {
+    char chunk[4096];
+    ssize_t count = read(fd, chunk, sizeof(chunk));
+    if (count < 0 && errno == EINTR) {
+        return true;
+    }
+    if (count <= 0) {
+        return false;
+    }
+    writeAll(echoFd, chunk, count);
+    char *grown = realloc(*buffer, *length + count);
+    if (grown == NULL) {
+        return true;
+    }
+    memcpy(grown + *length, chunk, count);
+    *buffer = grown;
+    *length += count;
+    return true;
+}
+
+/*
+ *  Runs the command, replaying stored stdout, stderr and exit status when an entry
+ *  with the same key exists. Otherwise the output is shown live and stored afterwards
+ */
+void runCached(char **arguments, char **inputFiles, int inputFileCount, char **envNames, int envNameCount) {
+    char *directory = getCacheDirectory();
+    char filename[MAX_INPUT_SIZE + 32];
+    long long keyLength;
+    char *key = buildCacheKey(arguments, inputFiles, inputFileCount, envNames, envNameCount, &keyLength);
+    snprintf(filename, sizeof(filename), "%s/%016llx", directory, hashCacheKey(key, keyLength));
+
+    fflush(stdout);
+    if (replayCacheEntry(filename, key, keyLength)) {
+        //Touch the entry so eviction sees it as recently used
+        utimensat(AT_FDCWD, filename, NULL, 0);
+        free(key);
+        free(directory);
+        return;
+    }
+
+    int outPipe[2];
+    int errPipe[2];
+    if (pipe(outPipe) < 0) {
+        perror("cache");
+        free(key);
+        free(directory);
+        return;
+    }
+    if (pipe(errPipe) < 0) {
+        perror("cache");
+        close(outPipe[0]);
+        close(outPipe[1]);
+        free(key);
+        free(directory);
+        return;
+    }
+
+    bool ownsTerminal = shellOwnsTerminal();
+    uint64_t spanStart = traceBegin();
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("Error forking\n");
+        close(outPipe[0]);
+        close(outPipe[1]);
+        close(errPipe[0]);
+        close(errPipe[1]);
+        free(key);
+        free(directory);
+        return;
+    }
+    if (pid == 0) {
+        //Child process
+        dup2(outPipe[1], STDOUT_FILENO);
+        dup2(errPipe[1], STDERR_FILENO);
+        close(outPipe[0]);
+        close(outPipe[1]);
+        close(errPipe[0]);
+        close(errPipe[1]);
+        //Cached commands are run under the session limits like any other command
+        applyLimits(&sessionLimits, ownsTerminal);
+        execvp(arguments[0], arguments);
+        perror(arguments[0]);
+        exit(127);
+    }
+
+    //Parent process
+    traceEnd(TRACE_FORK, spanStart);
+    //Capturing the output is part of waiting for the command
+    spanStart = traceBegin();
+    limitWatchdog watchdog;
+    startWatchdog(&watchdog, pid, &sessionLimits, ownsTerminal);
+    close(outPipe[1]);
+    close(errPipe[1]);
+    char *outBuffer = NULL;
+    char *errBuffer = NULL;
+    long long outLength = 0;
+    long long errLength = 0;
+    //The watchdog timer is polled too, so a command that hangs without output is still stopped
+    struct pollfd fds[3] = {{outPipe[0], POLLIN, 0}, {errPipe[0], POLLIN, 0}, {watchdog.timerFd, POLLIN, 0}};
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[2].revents & POLLIN) {
+            watchdogFired(&watchdog);
+        }
+        if (fds[0].revents && !captureOutput(fds[0].fd, STDOUT_FILENO, &outBuffer, &outLength)) {
+            close(fds[0].fd);
+            fds[0].fd = -1;
+        }
+        if (fds[1].revents && !captureOutput(fds[1].fd, STDERR_FILENO, &errBuffer, &errLength)) {
+            close(fds[1].fd);
+            fds[1].fd = -1;
+        }
+    }
+    if (fds[0].fd >= 0) {
+        close(fds[0].fd);
+    }
+    if (fds[1].fd >= 0) {
+        close(fds[1].fd);
+    }
+
+    int status = finishWatchdog(&watchdog, arguments[0]);
+    traceEnd(TRACE_WAIT, spanStart);
+
+    //Only store commands that finished on their own and fit in the cache
+    //Commands that could not be run are not stored, they may be installed later
+    //Runs under limits are not stored either, the key does not include the limits
+    //and a command that catches the watchdog's SIGTERM still exits normally
+    bool limited = hasLimits(&sessionLimits) || watchdog.timedOut || watchdog.killed;
+    if (WIFEXITED(status) && !limited && lastExitStatus != 127 && keyLength + outLength + errLength < getCacheSizeCap()) {
+        char tempFilename[MAX_INPUT_SIZE + 32];
+        snprintf(tempFilename, sizeof(tempFilename), "%s/tmp.XXXXXX", directory);
+        int fd = mkstemp(tempFilename);
+        if (fd >= 0) {
+            char header[128];
+            int headerLength = snprintf(header, sizeof(header), "SHCACHE2 %d %lld %lld %lld\n", lastExitStatus, keyLength, outLength, errLength);
+            writeAll(fd, header, headerLength);
+            writeAll(fd, key, keyLength);
+            writeAll(fd, outBuffer, outLength);
+            writeAll(fd, errBuffer, errLength);
+            close(fd);
+            //Rename so a half written entry is never replayed
+            if (rename(tempFilename, filename) < 0) {
+                unlink(tempFilename);
+            }
+            evictCacheEntries();
+        }
+    }
+
+    free(outBuffer);
+    free(errBuffer);
+    free(key);
+    free(directory);
+}
+
+/*
+ *  Replays the stored output and exit status of the entry at filename
+ *  Returns false if there is no valid entry or it was stored for a different key
+ */
+bool replayCacheEntry(char *filename, char *key, long long keyLength) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return false;
+    }
+    int status;
+    long long storedKeyLength;
+    long long outLength;
+    long long errLength;
+    if (fscanf(file, "SHCACHE2 %d %lld %lld %lld", &status, &storedKeyLength, &outLength, &errLength) != 4
+        || fgetc(file) != '\n' || storedKeyLength != keyLength || outLength < 0 || errLength < 0) {
+        fclose(file);
+        return false;
+    }
+    long long total = keyLength + outLength + errLength;
+    char *buffer = malloc(total + 1);
+    if (buffer == NULL || (long long)fread(buffer, 1, total, file) != total) {
+        free(buffer);
+        fclose(file);
+        return false;
+    }
+    //Two keys can hash to the same name, so only replay an exact match
+    if (memcmp(buffer, key, keyLength) != 0) {
+        free(buffer);
+        fclose(file);
+        return false;
+    }
+    writeAll(STDOUT_FILENO, buffer + keyLength, outLength);
+    writeAll(STDERR_FILENO, buffer + keyLength + outLength, errLength);
+    lastExitStatus = status;
+
+    free(buffer);
+    fclose(file);
+    return true;
+}
+
+/*
+ *  Appends a string (including its terminator) to the key, growing it as needed
+ */
+static void appendKeyPart(char **key, long long *length, long long *capacity, const char *part) {
+    long long partLength = strlen(part) + 1;
+    if (*length + partLength > *capacity) {
+        while (*length + partLength > *capacity) {
+            *capacity *= 2;
+        }
+        *key = realloc(*key, *capacity);
+    }
+    memcpy(*key + *length, part, partLength);
+    *length += partLength;
+}
+
+/*
+ *  Builds the key from everything the output of a command is assumed to depend on:
+ *  its arguments, the working directory, PATH, the named environment
+ *  variables and the size and modification time of the named input files
+ *  Caller must free the pointer
+ */
+char *buildCacheKey(char **arguments, char **inputFiles, int inputFileCount, char **envNames, int envNameCount, long long *length) {
+    long long capacity = MAX_INPUT_SIZE;
+    char *key = malloc(capacity);
+    char buffer[MAX_INPUT_SIZE];
+    *length = 0;
+
+    for (int i = 0; arguments[i] != NULL; i++) {
+        appendKeyPart(&key, length, &capacity, arguments[i]);
+    }
+    appendKeyPart(&key, length, &capacity, "\x01");
+
+    char *cwd = getcwd(NULL, 0);
+    appendKeyPart(&key, length, &capacity, cwd == NULL ? "" : cwd);
+    free(cwd);
+
+    char *path = getenv("PATH");
+    appendKeyPart(&key, length, &capacity, path == NULL ? "" : path);
+
+    for (int i = 0; i < envNameCount; i++) {
+        char *value = getenv(envNames[i]);
+        appendKeyPart(&key, length, &capacity, envNames[i]);
+        appendKeyPart(&key, length, &capacity, value == NULL ? "\x02" : value);
+    }
+
+    for (int i = 0; i < inputFileCount; i++) {
+        struct stat info;
+        appendKeyPart(&key, length, &capacity, inputFiles[i]);
+        if (stat(inputFiles[i], &info) < 0) {
+            appendKeyPart(&key, length, &capacity, "\x02");
+            continue;
+        }
+        snprintf(buffer, sizeof(buffer), "%lld %lld.%09ld", (long long)info.st_size, (long long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+        appendKeyPart(&key, length, &capacity, buffer);
+    }
+    return key;
+}
+
+/*
+ *  FNV-1a hash of the key, used to name its entry
+ */
+unsigned long long hashCacheKey(char *key, long long length) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (long long i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ *  Orders cache entries from least to most recently used
+ */
+static int compareCacheEntries(const void *first, const void *second) {
+    const cacheEntryInfo *a = first;
+    const cacheEntryInfo *b = second;
+    return (a->lastUsed > b->lastUsed) - (a->lastUsed < b->lastUsed);
+}
+
+/*
+ *  Lists the entries in the cache directory, returning how many were found
+ *  Caller must free the entries
+ */
+static int listCacheEntries(char *directory, cacheEntryInfo **entries, long long *totalSize) {
+    DIR *dir = opendir(directory);
+    int count = 0;
+    int capacity = 0;
+    *entries = NULL;
+    *totalSize = 0;
+    if (dir == NULL) {
+        return 0;
+    }
+    struct dirent *dirEntry;
+    while ((dirEntry = readdir(dir)) != NULL) {
+        if (dirEntry->d_name[0] == '.' || strncmp(dirEntry->d_name, "tmp.", 4) == 0) {
+            continue;
+        }
+        struct stat info;
+        char filename[MAX_INPUT_SIZE * 2];
+        snprintf(filename, sizeof(filename), "%s/%s", directory, dirEntry->d_name);
+        if (stat(filename, &info) < 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 32 : capacity * 2;
+            cacheEntryInfo *grown = realloc(*entries, capacity * sizeof(cacheEntryInfo));
+            if (grown == NULL) {
+                break;
+            }
+            *entries = grown;
+        }
+        strcpy((*entries)[count].name, filename);
+        (*entries)[count].size = info.st_size;
+        (*entries)[count].lastUsed = info.st_mtime;
+        *totalSize += info.st_size;
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/*
+ *  Removes the least recently used entries until the cache is under its size cap
+ */
+void evictCacheEntries() {
+    char *directory = getCacheDirectory();
+    cacheEntryInfo *entries;
+    long long totalSize;
+    int count = listCacheEntries(directory, &entries, &totalSize);
+    long long cap = getCacheSizeCap();
+
+    if (totalSize > cap) {
+        qsort(entries, count, sizeof(cacheEntryInfo), compareCacheEntries);
+        for (int i = 0; i < count && totalSize > cap; i++) {
+            if (unlink(entries[i].name) == 0) {
+                totalSize -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+    free(directory);
+}
+
+/*
+ *  Removes every entry from the cache
+ */
+void clearCache() {
+    char *directory = getCacheDirectory();
+    cacheEntryInfo *entries;
+    long long totalSize;
+    int count = listCacheEntries(directory, &entries, &totalSize);
+    for (int i = 0; i < count; i++) {
+        unlink(entries[i].name);
+    }
+    printf("Removed %d cache entries\n", count);
+    free(entries);
+    free(directory);
+}
+
+/*
+ *  Prints the number of entries, their total size and the size cap
+ */
+void printCacheStats() {
+    char *directory = getCacheDirectory();
+    cacheEntryInfo *entries;
+    long long totalSize;
+    int count = listCacheEntries(directory, &entries, &totalSize);
+    printf("Cache %s: %d entries, %lld of %lld bytes\n", directory, count, totalSize, getCacheSizeCap());
+    free(entries);
+    free(directory);
+}
+
+/*
+ *  Creates the name of the cache directory, creating the directory if needed
+ *  Caller must free the pointer
+ */
+char *getCacheDirectory() {
+    char *directory;
+    directory = calloc(MAX_INPUT_SIZE, 1);
+    strcat(directory, getenv("HOME"));
+    strcat(directory, CACHE_DIR_NAME);
+    mkdir(directory, 0700);
+    return directory;
+}
+
+/*
+ *  Parses a size such as 4096, 64K, 512M or 2G into bytes
+ *  Returns -1 if the string is not a valid size
+ */
+long long parseSize(char *string) {
+    char *end;
+    errno = 0;
+    long long size = strtoll(string, &end, 10);
+    if (end == string || errno != 0 || size < 0) {
+        return -1;
+    }
+    switch (toupper(*end)) {
+        case '\0':
+            return size;
+        case 'K':
+            size *= 1024LL;
+            break;
+        case 'M':
+            size *= 1024LL * 1024;
+            break;
+        case 'G':
+            size *= 1024LL * 1024 * 1024;
+            break;
+        default:
+            return -1;
+    }
+    //Allow an optional trailing B, as in 512MB
+    if (end[1] != '\0' && !(toupper(end[1]) == 'B' && end[2] == '\0')) {
+        return -1;
+    }
+    return size;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <time.h>
+#include "common.h"
+
+#define CACHE_DIR_NAME "/.shell_cache"
+#define CACHE_SIZE_ENV "SHELL_CACHE_SIZE"
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define MAX_CACHE_INPUTS 10
+
+struct cacheEntryInfo {
+    char name[MAX_INPUT_SIZE * 2];
+    long long size;
+    time_t lastUsed;
+} typedef cacheEntryInfo;
+
+void cacheCommand(char **arguments);
+void runCached(char **arguments, char **inputFiles, int inputFileCount, char **envNames, int envNameCount);
+void clearCache();
+void printCacheStats();
+void evictCacheEntries();
+
+char *buildCacheKey(char **arguments, char **inputFiles, int inputFileCount, char **envNames, int envNameCount, long long *length);
+unsigned long long hashCacheKey(char *key, long long length);
+bool replayCacheEntry(char *filename, char *key, long long keyLength);
+char *getCacheDirectory();
+long long parseSize(char *string);
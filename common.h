@@ -5,3 +5,6 @@
 #include <unistd.h>
 
 #define MAX_INPUT_SIZE 512
+
+//Exit status of the last command that was run, 0 for internal commands
+extern int lastExitStatus;
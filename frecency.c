@@ -0,0 +1,348 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "frecency.h"
+
+static frecencyDatabase *database = NULL;
+static bool databaseFailed = false;
+
+//Most recently left directory first
+static char directoryStack[MAX_DIRECTORY_STACK][MAX_INPUT_SIZE];
+static int directoryStackCount = 0;
+
+/*
+ *  Maps the frecency file into memory, creating it if needed
+ *  Returns NULL if the file cannot be used
+ */
+static frecencyDatabase *openFrecencyDatabase() {
+    if (database != NULL || databaseFailed) {
+        return database;
+    }
+    databaseFailed = true;
+    char *filename = getFrecencyFilename();
+    int fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror(filename);
+        free(filename);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (info.st_size < (off_t)sizeof(frecencyDatabase) && ftruncate(fd, sizeof(frecencyDatabase)) < 0)) {
+        perror(filename);
+        close(fd);
+        free(filename);
+        return NULL;
+    }
+    void *mapped = mmap(NULL, sizeof(frecencyDatabase), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror(filename);
+        free(filename);
+        return NULL;
+    }
+
+    frecencyDatabase *opened = mapped;
+    uint32_t emptyMagic = 0;
+    //A new file is all zeroes, claim it unless another shell already has
+    __atomic_compare_exchange_n(&opened->magic, &emptyMagic, FRECENCY_MAGIC, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if (opened->magic != FRECENCY_MAGIC) {
+        printf("Ignoring %s: unknown format\n", filename);
+        munmap(mapped, sizeof(frecencyDatabase));
+        free(filename);
+        return NULL;
+    }
+    free(filename);
+    database = opened;
+    databaseFailed = false;
+    return database;
+}
+
+/*
+ *  Visit count weighted by how recently the directory was visited
+ */
+double frecencyScore(frecencyEntry *entry, int64_t now) {
+    uint32_t visits = __atomic_load_n(&entry->visits, __ATOMIC_ACQUIRE);
+    if (visits == FRECENCY_CLAIMED) {
+        return 0;
+    }
+    int64_t age = now - __atomic_load_n(&entry->lastVisit, __ATOMIC_RELAXED);
+    if (age < 60 * 60) {
+        return visits * 4.0;
+    } else if (age < 24 * 60 * 60) {
+        return visits * 2.0;
+    } else if (age < 7 * 24 * 60 * 60) {
+        return visits * 0.5;
+    }
+    return visits * 0.25;
+}
+
+/*
+ *  Copies the path of a live entry, checking it was not replaced while being copied
+ *  The generation is compared rather than visits, since a replaced entry
+ *  usually ends up with the same visit count as the one it replaced
+ *  Returns false if the entry is free or being written
+ */
+static bool readEntry(frecencyEntry *entry, char *path, uint32_t *visits) {
+    while (true) {
+        uint32_t generation = __atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE);
+        uint32_t before = __atomic_load_n(&entry->visits, __ATOMIC_ACQUIRE);
+        if (before == 0 || before == FRECENCY_CLAIMED) {
+            return false;
+        }
+        memcpy(path, entry->path, MAX_INPUT_SIZE);
+        path[MAX_INPUT_SIZE - 1] = '\0';
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t after = __atomic_load_n(&entry->visits, __ATOMIC_RELAXED);
+        if (after != 0 && after != FRECENCY_CLAIMED && __atomic_load_n(&entry->generation, __ATOMIC_RELAXED) == generation) {
+            *visits = after;
+            return true;
+        }
+    }
+}
+
+/*
+ *  Takes entry for writing if it still has the visit count seen when it was chosen
+ *  Only one shell can win, the others choose again
+ */
+static bool claimEntry(frecencyEntry *entry, uint32_t visits) {
+    if (visits == FRECENCY_CLAIMED
+        || !__atomic_compare_exchange_n(&entry->visits, &visits, FRECENCY_CLAIMED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    //Before the path is touched, so readers copying it see the entry changed
+    __atomic_fetch_add(&entry->generation, 1, __ATOMIC_ACQ_REL);
+    return true;
+}
+
+/*
+ *  Records a visit to path. Fields are updated atomically so other shells
+ *  sharing the file never see a half written entry
+ */
+void recordDirectoryVisit(char *path) {
+    frecencyDatabase *db = openFrecencyDatabase();
+    if (db == NULL || strlen(path) >= MAX_INPUT_SIZE) {
+        return;
+    }
+    int64_t now = time(NULL);
+    uint32_t count = __atomic_load_n(&db->count, __ATOMIC_ACQUIRE);
+
+    for (uint32_t i = 0; i < count && i < MAX_FRECENCY_ENTRIES; i++) {
+        frecencyEntry *entry = &db->entries[i];
+        char entryPath[MAX_INPUT_SIZE];
+        uint32_t visits;
+        while (readEntry(entry, entryPath, &visits) && strcmp(entryPath, path) == 0) {
+            //Fails if another shell counted a visit or replaced the entry meanwhile
+            if (__atomic_compare_exchange_n(&entry->visits, &visits, visits + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&entry->lastVisit, now, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+    }
+
+    //Claim a new slot, or replace the lowest scoring entry when full
+    frecencyEntry *entry = NULL;
+    while (entry == NULL) {
+        if (count < MAX_FRECENCY_ENTRIES) {
+            if (__atomic_compare_exchange_n(&db->count, &count, count + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                //A shell replacing entries may have taken the new slot first
+                if (claimEntry(&db->entries[count], 0)) {
+                    entry = &db->entries[count];
+                }
+                count++;
+            }
+            continue;
+        }
+        frecencyEntry *lowest = NULL;
+        uint32_t lowestVisits = 0;
+        for (int i = 0; i < MAX_FRECENCY_ENTRIES; i++) {
+            uint32_t visits = __atomic_load_n(&db->entries[i].visits, __ATOMIC_ACQUIRE);
+            if (visits != FRECENCY_CLAIMED && (lowest == NULL || frecencyScore(&db->entries[i], now) < frecencyScore(lowest, now))) {
+                lowest = &db->entries[i];
+                lowestVisits = visits;
+            }
+        }
+        if (lowest == NULL) {
+            //Every entry is being written by another shell
+            return;
+        }
+        if (claimEntry(lowest, lowestVisits)) {
+            entry = lowest;
+        }
+    }
+    snprintf(entry->path, MAX_INPUT_SIZE, "%s", path);
+    __atomic_store_n(&entry->lastVisit, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->visits, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Returns true if haystack contains needle, ignoring case
+ */
+static bool containsIgnoreCase(char *haystack, char *needle) {
+    size_t needleLength = strlen(needle);
+    for (char *start = haystack; *start != '\0'; start++) {
+        size_t i = 0;
+        while (i < needleLength && tolower((unsigned char)start[i]) == tolower((unsigned char)needle[i])) {
+            i++;
+        }
+        if (i == needleLength) {
+            return true;
+        }
+    }
+    return needleLength == 0;
+}
+
+/*
+ *  Scores entry against part, 0 if it does not match
+ *  Matches in the last path component rank above matches further up
+ *  The path that was scored is copied into path
+ */
+static double matchScore(frecencyEntry *entry, char *part, int64_t now, char *path) {
+    uint32_t visits;
+    if (!readEntry(entry, path, &visits) || !containsIgnoreCase(path, part)) {
+        return 0;
+    }
+    double score = frecencyScore(entry, now);
+    char *lastComponent = strrchr(path, '/');
+    if (lastComponent != NULL && containsIgnoreCase(lastComponent + 1, part)) {
+        score *= 10;
+    }
+    return score;
+}
+
+/*
+ *  Finds the best visited directory matching part, other than exclude, from the index alone
+ *  Returns false if nothing matches
+ */
+bool findFrecentDirectory(char *part, char *exclude, char *result) {
+    frecencyDatabase *db = openFrecencyDatabase();
+    if (db == NULL) {
+        return false;
+    }
+    int64_t now = time(NULL);
+    uint32_t count = __atomic_load_n(&db->count, __ATOMIC_ACQUIRE);
+    double bestScore = 0;
+
+    for (uint32_t i = 0; i < count && i < MAX_FRECENCY_ENTRIES; i++) {
+        char path[MAX_INPUT_SIZE];
+        double score = matchScore(&db->entries[i], part, now, path);
+        if (score > bestScore && (exclude == NULL || strcmp(path, exclude) != 0)) {
+            bestScore = score;
+            snprintf(result, MAX_INPUT_SIZE, "%s", path);
+        }
+    }
+    return bestScore > 0;
+}
+
+/*
+ *  Prints the highest scoring directories matching part, or all if part is NULL
+ */
+void printFrecentDirectories(char *part) {
+    frecencyDatabase *db = openFrecencyDatabase();
+    if (db == NULL) {
+        return;
+    }
+    int64_t now = time(NULL);
+    uint32_t count = __atomic_load_n(&db->count, __ATOMIC_ACQUIRE);
+    char best[MAX_LISTED_DIRECTORIES][MAX_INPUT_SIZE];
+    double bestScores[MAX_LISTED_DIRECTORIES];
+    int listed = 0;
+
+    //Keep the top entries in order with an insertion sort, copying the paths
+    //so an entry replaced by another shell does not change what is printed
+    for (uint32_t i = 0; i < count && i < MAX_FRECENCY_ENTRIES; i++) {
+        char path[MAX_INPUT_SIZE];
+        double score = matchScore(&db->entries[i], part == NULL ? "" : part, now, path);
+        if (score <= 0 || (listed == MAX_LISTED_DIRECTORIES && score <= bestScores[listed - 1])) {
+            continue;
+        }
+        int position = listed < MAX_LISTED_DIRECTORIES ? listed++ : listed - 1;
+        while (position > 0 && bestScores[position - 1] < score) {
+            strcpy(best[position], best[position - 1]);
+            bestScores[position] = bestScores[position - 1];
+            position--;
+        }
+        strcpy(best[position], path);
+        bestScores[position] = score;
+    }
+
+    if (listed == 0) {
+        printf("No visited directories%s%s\n", part == NULL ? "" : " match ", part == NULL ? "" : part);
+        return;
+    }
+    for (int i = 0; i < listed; i++) {
+        printf("%8.1f %s\n", bestScores[i], best[i]);
+    }
+}
+
+/*
+ *  Puts path on top of the directory stack, removing an older copy of it
+ */
+void pushDirectory(char *path) {
+    int position = -1;
+    for (int i = 0; i < directoryStackCount; i++) {
+        if (strcmp(directoryStack[i], path) == 0) {
+            position = i;
+            break;
+        }
+    }
+    if (position < 0) {
+        //Drop the oldest directory when the stack is full
+        position = directoryStackCount < MAX_DIRECTORY_STACK ? directoryStackCount++ : MAX_DIRECTORY_STACK - 1;
+    }
+    for (int i = position; i > 0; i--) {
+        strcpy(directoryStack[i], directoryStack[i - 1]);
+    }
+    snprintf(directoryStack[0], MAX_INPUT_SIZE, "%s", path);
+}
+
+/*
+ *  Returns the directory at index on the stack, 1 being the last one left
+ *  Returns NULL if there is no such entry
+ */
+char *getStackDirectory(int index) {
+    if (index < 1 || index > directoryStackCount) {
+        return NULL;
+    }
+    return directoryStack[index - 1];
+}
+
+/*
+ *  Built-in command showing the directory stack, or with -l the most frecent directories
+ */
+void directoriesCommand(char **arguments) {
+    if (arguments[1] != NULL && strcmp(arguments[1], "-l") == 0) {
+        if (arguments[2] != NULL && arguments[3] != NULL) {
+            printf("Too many arguments for dirs -l\n");
+            lastExitStatus = 1;
+            return;
+        }
+        printFrecentDirectories(arguments[2]);
+        return;
+    }
+    if (arguments[1] != NULL) {
+        printf("Unknown option for dirs: %s\n", arguments[1]);
+        lastExitStatus = 1;
+        return;
+    }
+    char *cwd = getcwd(NULL, 0);
+    printf("0 %s\n", cwd == NULL ? "?" : cwd);
+    free(cwd);
+    for (int i = 0; i < directoryStackCount; i++) {
+        printf("%d %s\n", i + 1, directoryStack[i]);
+    }
+}
+
+/*
+ *  Creates the filename for the frecency file and returns a pointer to it
+ *  Caller must free the pointer
+ */
+char *getFrecencyFilename() {
+    char *filename;
+    filename = calloc(MAX_INPUT_SIZE, 1);
+    strcat(filename, getenv("HOME"));
+    strcat(filename, FRECENCY_FILE_NAME);
+    return filename;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include "common.h"
+
+#define FRECENCY_FILE_NAME "/.dir_frecency"
+#define FRECENCY_MAGIC 0x31434552
+#define MAX_FRECENCY_ENTRIES 512
+#define MAX_DIRECTORY_STACK 10
+#define MAX_LISTED_DIRECTORIES 10
+//Visit count of an entry a shell has claimed to write
+#define FRECENCY_CLAIMED UINT32_MAX
+
+//Entries with no visits are free, claimed entries are being written
+//generation changes every time the entry is claimed, it fills what was padding
+//so files written before it was added keep the same layout
+struct frecencyEntry {
+    char path[MAX_INPUT_SIZE];
+    uint32_t visits;
+    uint32_t generation;
+    int64_t lastVisit;
+} typedef frecencyEntry;
+
+//Layout of the memory mapped frecency file
+struct frecencyDatabase {
+    uint32_t magic;
+    uint32_t count;
+    frecencyEntry entries[MAX_FRECENCY_ENTRIES];
+} typedef frecencyDatabase;
+
+void recordDirectoryVisit(char *path);
+bool findFrecentDirectory(char *part, char *exclude, char *result);
+void printFrecentDirectories(char *part);
+double frecencyScore(frecencyEntry *entry, int64_t now);
+
+void pushDirectory(char *path);
+char *getStackDirectory(int index);
+void directoriesCommand(char **arguments);
+
+char *getFrecencyFilename();
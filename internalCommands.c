@@ -1,4 +1,6 @@
 #include "internalCommands.h"
+#include "trace.h"
+#include "frecency.h"
 
 /*
  *   Exits the shell
@@ -7,7 +9,9 @@
  */
 void exitShell(historyCommand *history) {
     saveAliasesFile();
+    uint64_t spanStart = traceBegin();
     saveHistoryToFile(history);
+    traceEnd(TRACE_HISTORY, spanStart);
     setenv("PATH", originalPath, 1);
     printf("Last PATH check whilst exiting: %s\n", getenv("PATH"));
     exit(0);
@@ -19,6 +23,7 @@ void exitShell(historyCommand *history) {
 void getPath(char **arguments) {
     if (arguments[1] != NULL) {
             printf("Too many arguments for getPath\n"); 
+            lastExitStatus = 1;
             return;
         }
     printf("PATH: %s\n", getenv("PATH"));
@@ -30,14 +35,19 @@ void getPath(char **arguments) {
 void setPath(char **arguments) {  
     if (arguments[1] == NULL) {
         fprintf(stderr, "setpath requires an argument: provide a path\n");
+        lastExitStatus = 1;
         return;
     }
     if (arguments[2] != NULL) {
         printf("Too many arguments for setpath: provide only one path\n");
+        lastExitStatus = 1;
         return;
     }
     if (strcmp(arguments[1], "HOME") == 0) {
-        chdir(getenv("HOME"));  
+        if (chdir(getenv("HOME")) == -1) {
+            perror(getenv("HOME"));
+            lastExitStatus = 1;
+        }
 	char *cwd = getcwd(NULL, 0);
         printf("Current working directory: %s\n", cwd);
         free(cwd);
@@ -49,17 +59,47 @@ void setPath(char **arguments) {
 
 /*
  * Changes the working directory
+ * cd -j part jumps to the most frecent visited directory matching part
+ * cd +n goes back to entry n of the directory stack
  */
 void changeDirectory(char **arguments) {
     char *firstArgument = arguments[1];
+    bool isJump = firstArgument != NULL && strcmp("-j", firstArgument) == 0;
     //Check for too many arguments
-    if (arguments[2] != NULL) {
+    if (firstArgument != NULL && arguments[2] != NULL && (!isJump || arguments[3] != NULL)) {
         printf("Too many arguments for cd: provide only one directory\n");
+        lastExitStatus = 1;
         return;
     }
+    //Asked for each time, other commands such as setpath also change directory
+    char *previous = getcwd(NULL, 0);
     if (firstArgument == NULL) {
         //Change to home
-        chdir(getenv("HOME"));
+        if (chdir(getenv("HOME")) == -1) {
+            perror(getenv("HOME"));
+            lastExitStatus = 1;
+        }
+    } else if (isJump) {
+        char target[MAX_INPUT_SIZE];
+        if (arguments[2] == NULL) {
+            printf("cd -j requires part of a directory name\n");
+            lastExitStatus = 1;
+        } else if (!findFrecentDirectory(arguments[2], previous, target)) {
+            printf("No visited directory matches %s\n", arguments[2]);
+            lastExitStatus = 1;
+        } else if (chdir(target) == -1) {
+            perror(target);
+            lastExitStatus = 1;
+        }
+    } else if (firstArgument[0] == '+' && firstArgument[1] != '\0') {
+        char *target = getStackDirectory(atoi(firstArgument + 1));
+        if (target == NULL) {
+            printf("No directory %s on the stack\n", firstArgument);
+            lastExitStatus = 1;
+        } else if (chdir(target) == -1) {
+            perror(target);
+            lastExitStatus = 1;
+        }
     } else {
         if (strcmp(".", firstArgument) == 0) {
             chdir(".");
@@ -68,13 +108,20 @@ void changeDirectory(char **arguments) {
         } else { 
             if(chdir(firstArgument) == -1) {
 		perror(firstArgument);
+		lastExitStatus = 1;
             }
           }
       }
     //getcwd mallocs the size for us
     char *cwd = getcwd(NULL, 0);
+    //Remember where we came from and index where we went
+    if (cwd != NULL && previous != NULL && strcmp(cwd, previous) != 0) {
+        pushDirectory(previous);
+        recordDirectoryVisit(cwd);
+    }
     printf("Current working directory: %s\n", cwd);
     free(cwd);
+    free(previous);
 }
 
 /*
@@ -83,6 +130,7 @@ void changeDirectory(char **arguments) {
 void printHistory(char **arguments, historyCommand *history) {
     if (arguments[1] != NULL) {
         printf("Too many arguments for history\n");
+        lastExitStatus = 1;
         return;
     }
     for (int i = 0; i < MAX_HISTORY_COUNT; i++) {
@@ -0,0 +1,373 @@
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "limit.h"
+#include "cache.h"
+#include "trace.h"
+
+//Limits applied to every external command, set by limit without a command
+commandLimits sessionLimits = {0};
+
+/*
+ *  Handles the limit builtin
+ *  limit                       prints the limits applied to every command
+ *  limit off                   removes those limits
+ *  limit [options]             applies the options to every command
+ *  limit [options] command     runs a single command under the options
+ *  Options: -t wall time, -g grace period before SIGKILL, -c CPU seconds,
+ *           -m address space, -f file size, -n open files
+ */
+void limitCommand(char **arguments) {
+    if (arguments[1] == NULL) {
+        printLimits(&sessionLimits);
+        return;
+    }
+    if (strcmp(arguments[1], "off") == 0) {
+        if (arguments[2] != NULL) {
+            printf("Too many arguments for limit off\n");
+            lastExitStatus = 1;
+            return;
+        }
+        memset(&sessionLimits, 0, sizeof(sessionLimits));
+        printf("Removed all command limits\n");
+        return;
+    }
+
+    commandLimits limits = sessionLimits;
+    int commandIndex = parseLimits(arguments, &limits);
+    if (commandIndex < 0) {
+        return;
+    }
+    if (arguments[commandIndex] == NULL) {
+        sessionLimits = limits;
+        printLimits(&sessionLimits);
+        return;
+    }
+    runLimited(arguments + commandIndex, &limits);
+}
+
+/*
+ *  Reads the limit options into limits
+ *  Returns the index of the first argument after the options, or -1 on error
+ */
+int parseLimits(char **arguments, commandLimits *limits) {
+    int i = 1;
+    while (arguments[i] != NULL && arguments[i][0] == '-') {
+        char option = arguments[i][1];
+        char *value = arguments[i + 1];
+        if (arguments[i][2] != '\0' || strchr("tgcmfn", option) == NULL) {
+            printf("Unknown option for limit: %s\n", arguments[i]);
+            lastExitStatus = 1;
+            return -1;
+        }
+        if (value == NULL) {
+            printf("Missing value for limit %s\n", arguments[i]);
+            lastExitStatus = 1;
+            return -1;
+        }
+
+        long long parsed;
+        if (option == 't' || option == 'g' || option == 'c') {
+            parsed = parseDuration(value);
+        } else {
+            parsed = parseSize(value);
+        }
+        if (parsed <= 0) {
+            printf("Invalid value for limit %s: %s\n", arguments[i], value);
+            lastExitStatus = 1;
+            return -1;
+        }
+
+        switch (option) {
+            case 't':
+                limits->wallMillis = parsed;
+                break;
+            case 'g':
+                limits->graceMillis = parsed;
+                break;
+            case 'c':
+                //Round up, the CPU limit only has a resolution of seconds
+                limits->cpuSeconds = (parsed + 999) / 1000;
+                break;
+            case 'm':
+                limits->memoryBytes = parsed;
+                break;
+            case 'f':
+                limits->fileBytes = parsed;
+                break;
+            case 'n':
+                limits->openFiles = parsed;
+                break;
+        }
+        i += 2;
+    }
+    return i;
+}
+
+/*
+ *  Prints the limits that are set
+ */
+void printLimits(commandLimits *limits) {
+    if (!hasLimits(limits)) {
+        printf("No command limits set\n");
+        return;
+    }
+    if (limits->wallMillis > 0) {
+        printf("Wall time: %lldms (grace %lldms)\n", limits->wallMillis,
+               limits->graceMillis > 0 ? limits->graceMillis : DEFAULT_GRACE_MILLIS);
+    }
+    if (limits->cpuSeconds > 0) {
+        printf("CPU time: %llds\n", limits->cpuSeconds);
+    }
+    if (limits->memoryBytes > 0) {
+        printf("Memory: %lld bytes\n", limits->memoryBytes);
+    }
+    if (limits->fileBytes > 0) {
+        printf("File size: %lld bytes\n", limits->fileBytes);
+    }
+    if (limits->openFiles > 0) {
+        printf("Open files: %lld\n", limits->openFiles);
+    }
+}
+
+/*
+ *  Returns true if any limit other than the grace period is set
+ */
+bool hasLimits(commandLimits *limits) {
+    return limits->wallMillis > 0 || limits->cpuSeconds > 0 || limits->memoryBytes > 0
+        || limits->fileBytes > 0 || limits->openFiles > 0;
+}
+
+/*
+ *  Returns the time between SIGTERM and SIGKILL
+ */
+static long long getGraceMillis(commandLimits *limits) {
+    return limits->graceMillis > 0 ? limits->graceMillis : DEFAULT_GRACE_MILLIS;
+}
+
+/*
+ *  Sets a resource limit in the child, reporting if it could not be applied
+ */
+static void applyResourceLimit(int resource, long long value, char *name) {
+    if (value <= 0) {
+        return;
+    }
+    struct rlimit limit = {value, value};
+    if (setrlimit(resource, &limit) < 0) {
+        perror(name);
+    }
+}
+
+/*
+ *  Makes group the terminal's foreground group, so a command in its own
+ *  process group can still read from the terminal
+ */
+static void setTerminalGroup(pid_t group) {
+    //Changing the foreground group from a background group raises SIGTTOU
+    void (*previous)(int) = signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN_FILENO, group);
+    signal(SIGTTOU, previous);
+}
+
+/*
+ *  Arms the timer to fire once after the given number of milliseconds
+ */
+static void armTimer(int timerFd, long long millis) {
+    struct itimerspec spec = {{0, 0}, {millis / 1000, (millis % 1000) * 1000000}};
+    timerfd_settime(timerFd, 0, &spec, NULL);
+}
+
+/*
+ *  Returns true if the shell is the terminal's foreground group, and so can hand it on
+ */
+bool shellOwnsTerminal() {
+    return isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+}
+
+/*
+ *  Called in the child before exec. Moves it to its own process group, so the
+ *  watchdog can signal everything the command starts, and sets the resource limits
+ */
+void applyLimits(commandLimits *limits, bool ownsTerminal) {
+    if (!hasLimits(limits)) {
+        return;
+    }
+    setpgid(0, 0);
+    if (ownsTerminal) {
+        setTerminalGroup(getpid());
+    }
+    applyResourceLimit(RLIMIT_CPU, limits->cpuSeconds, "limit -c");
+    applyResourceLimit(RLIMIT_AS, limits->memoryBytes, "limit -m");
+    applyResourceLimit(RLIMIT_FSIZE, limits->fileBytes, "limit -f");
+    applyResourceLimit(RLIMIT_NOFILE, limits->openFiles, "limit -n");
+}
+
+/*
+ *  Called in the parent after forking. Arms the wall-clock timer if there is a limit
+ *  Callers that also wait on other descriptors poll watchdog->timerFd and call watchdogFired
+ */
+void startWatchdog(limitWatchdog *watchdog, pid_t pid, commandLimits *limits, bool ownsTerminal) {
+    watchdog->pid = pid;
+    watchdog->limits = limits;
+    watchdog->active = hasLimits(limits);
+    watchdog->ownsTerminal = ownsTerminal && watchdog->active;
+    watchdog->timedOut = false;
+    watchdog->killed = false;
+    watchdog->timerFd = -1;
+    watchdog->pidFd = -1;
+    if (!watchdog->active) {
+        return;
+    }
+
+    //Also set here, as the child may not have run yet when it is signalled
+    setpgid(pid, pid);
+    if (watchdog->ownsTerminal) {
+        setTerminalGroup(pid);
+    }
+    if (limits->wallMillis > 0) {
+        watchdog->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (watchdog->timerFd < 0) {
+            perror("limit: timerfd");
+            return;
+        }
+        watchdog->pidFd = syscall(SYS_pidfd_open, pid, 0);
+        armTimer(watchdog->timerFd, limits->wallMillis);
+    }
+}
+
+/*
+ *  Handles the timer firing: SIGTERM to the command's group the first time,
+ *  then SIGKILL once the grace period is over
+ */
+void watchdogFired(limitWatchdog *watchdog) {
+    unsigned long long expirations;
+    read(watchdog->timerFd, &expirations, sizeof(expirations));
+    if (!watchdog->timedOut) {
+        watchdog->timedOut = true;
+        kill(-watchdog->pid, SIGTERM);
+        armTimer(watchdog->timerFd, getGraceMillis(watchdog->limits));
+    } else if (!watchdog->killed) {
+        watchdog->killed = true;
+        kill(-watchdog->pid, SIGKILL);
+    }
+}
+
+/*
+ *  Waits for the command to exit while the watchdog runs, sets lastExitStatus
+ *  and reports which limit stopped the command
+ *  Returns the wait status
+ */
+int finishWatchdog(limitWatchdog *watchdog, char *name) {
+    int status;
+    struct rusage usage;
+    commandLimits *limits = watchdog->limits;
+
+    if (watchdog->timerFd < 0) {
+        wait4(watchdog->pid, &status, 0, &usage);
+    } else {
+        struct pollfd fds[2] = {{watchdog->timerFd, POLLIN, 0}, {watchdog->pidFd, POLLIN, 0}};
+        while (true) {
+            //Without a pidfd, check on the child every few milliseconds instead
+            int result = poll(fds, watchdog->pidFd >= 0 ? 2 : 1, watchdog->pidFd >= 0 ? -1 : 10);
+            if (wait4(watchdog->pid, &status, WNOHANG, &usage) == watchdog->pid) {
+                break;
+            }
+            if (result > 0 && (fds[0].revents & POLLIN)) {
+                watchdogFired(watchdog);
+            }
+        }
+        if (watchdog->pidFd >= 0) {
+            close(watchdog->pidFd);
+        }
+        close(watchdog->timerFd);
+    }
+    if (watchdog->ownsTerminal) {
+        setTerminalGroup(getpgrp());
+    }
+
+    lastExitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (!watchdog->active) {
+        return status;
+    }
+
+    //Say which limit stopped the command
+    long long cpuMillis = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000LL
+                        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+    int signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    if (watchdog->killed) {
+        printf("limit: %s exceeded wall time of %lldms, killed after %lldms grace\n", name, limits->wallMillis, getGraceMillis(limits));
+    } else if (watchdog->timedOut) {
+        printf("limit: %s exceeded wall time of %lldms, terminated\n", name, limits->wallMillis);
+    } else if (signal == SIGXCPU || (signal == SIGKILL && limits->cpuSeconds > 0 && cpuMillis + CPU_LIMIT_SLACK_MILLIS >= limits->cpuSeconds * 1000)) {
+        printf("limit: %s exceeded CPU time of %llds\n", name, limits->cpuSeconds);
+    } else if (signal == SIGXFSZ) {
+        printf("limit: %s exceeded file size of %lld bytes\n", name, limits->fileBytes);
+    } else if (limits->memoryBytes > 0 && (signal == SIGSEGV || signal == SIGBUS || signal == SIGABRT || signal == SIGKILL)) {
+        //Running out of memory shows up as a failed allocation, so the cause cannot be certain
+        //A plain non-zero exit is left alone, it is usually just the command's own answer
+        printf("limit: %s was killed by signal %d, probably by exceeding the memory limit of %lld bytes\n",
+               name, signal, limits->memoryBytes);
+    }
+    return status;
+}
+
+/*
+ *  Runs the command with the resource limits set in the child, and kills it
+ *  with SIGTERM then SIGKILL if it outlives the wall-clock limit
+ *  Reports which limit stopped the command
+ */
+void runLimited(char **arguments, commandLimits *limits) {
+    bool ownsTerminal = shellOwnsTerminal();
+    fflush(stdout);
+    uint64_t spanStart = traceBegin();
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("Error forking\n");
+        return;
+    }
+    if (pid == 0) {
+        //Child process
+        applyLimits(limits, ownsTerminal);
+        execvp(arguments[0], arguments);
+        perror(arguments[0]);
+        exit(127);
+    }
+
+    //Parent process
+    traceEnd(TRACE_FORK, spanStart);
+    spanStart = traceBegin();
+    limitWatchdog watchdog;
+    startWatchdog(&watchdog, pid, limits, ownsTerminal);
+    finishWatchdog(&watchdog, arguments[0]);
+    traceEnd(TRACE_WAIT, spanStart);
+}
+
+/*
+ *  Parses a duration such as 500ms, 5s, 2m or 1h into milliseconds
+ *  A number without a unit is in seconds
+ *  Returns -1 if the string is not a valid duration
+ */
+long long parseDuration(char *string) {
+    char *end;
+    errno = 0;
+    double value = strtod(string, &end);
+    if (end == string || errno != 0 || value < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        return (long long)value;
+    } else if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) {
+        return (long long)(value * 1000);
+    } else if (strcmp(end, "m") == 0) {
+        return (long long)(value * 60 * 1000);
+    } else if (strcmp(end, "h") == 0) {
+        return (long long)(value * 60 * 60 * 1000);
+    }
+    return -1;
+}
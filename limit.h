@@ -0,0 +1,43 @@
+#pragma once
+#include "common.h"
+
+#define DEFAULT_GRACE_MILLIS 2000
+//The kernel enforces CPU limits at tick granularity, so reported usage can fall just short
+#define CPU_LIMIT_SLACK_MILLIS 50
+
+//A value of 0 means the limit is not set
+struct commandLimits {
+    long long wallMillis;
+    long long graceMillis;
+    long long cpuSeconds;
+    long long memoryBytes;
+    long long fileBytes;
+    long long openFiles;
+} typedef commandLimits;
+
+//Kills a limited command that runs past its wall-clock limit
+struct limitWatchdog {
+    pid_t pid;
+    commandLimits *limits;
+    bool active;
+    bool ownsTerminal;
+    bool timedOut;
+    bool killed;
+    int timerFd;
+    int pidFd;
+} typedef limitWatchdog;
+
+void limitCommand(char **arguments);
+void runLimited(char **arguments, commandLimits *limits);
+int parseLimits(char **arguments, commandLimits *limits);
+void printLimits(commandLimits *limits);
+bool hasLimits(commandLimits *limits);
+long long parseDuration(char *string);
+
+bool shellOwnsTerminal();
+void applyLimits(commandLimits *limits, bool ownsTerminal);
+void startWatchdog(limitWatchdog *watchdog, pid_t pid, commandLimits *limits, bool ownsTerminal);
+void watchdogFired(limitWatchdog *watchdog);
+int finishWatchdog(limitWatchdog *watchdog, char *name);
+
+extern commandLimits sessionLimits;
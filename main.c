@@ -6,6 +6,12 @@
 #include "alias.h"
 #include "history.h"
 #include "internalCommands.h"
+#include "cache.h"
+#include "limit.h"
+#include "trace.h"
+#include "script.h"
+#include "prompt.h"
+#include "frecency.h"
 
 #define MAX_ARGUMENTS 50
 
@@ -13,6 +19,7 @@ void getInput(char *input, historyCommand *history);
 void parse(char *input, char **arguments);
 void executeCommand(char **arguments, historyCommand *history);
 void execute(char **arguments);
+bool lookupCommand(char *command, char *path);
 void executeHistoryCommand(char **arguments, historyCommand *history, int historyNumber);
 void repeatLastCommand(char **arguments, historyCommand *history, int historyCount);
 void repeatPastCommand(char **arguments, historyCommand *history, int historyCount);
@@ -24,11 +31,13 @@ void joinArguments(char **arguments, char *string);
 
 alias aliases[MAX_ALIASES] = {{{0}}, {{0}}};
 char *originalPath;
+int lastExitStatus = 0;
 
 int main() {
     originalPath = getenv("PATH");
     printf("Initial PATH: %s\n", originalPath);
     chdir(getenv("HOME"));
+    initTracing();
     int historyCount = 0;
     historyCommand history[MAX_HISTORY_COUNT] = {{0}};
     readHistoryFile(history, &historyCount);
@@ -39,13 +48,29 @@ int main() {
         //Parse that input
         char input[MAX_INPUT_SIZE] = {'\0'};
         char *arguments[MAX_ARGUMENTS];
+        uint64_t spanStart = traceBegin();
         getInput(input, history);
+        traceEnd(TRACE_INPUT, spanStart);
+
+        if (isScriptStart(input)) {
+            //Control flow, functions and assignments are compiled and run by the script interpreter
+            char historyLine[MAX_INPUT_SIZE];
+            if (runScriptBlock(input, history, historyLine)) {
+                saveCommand(historyLine, history, historyCount);
+                historyCount++;
+            }
+            continue;
+        }
 
         char unAliasedInput[MAX_INPUT_SIZE];
         strcpy(unAliasedInput, input);
 
+        spanStart = traceBegin();
         replaceAlias(input);
+        traceEnd(TRACE_ALIAS, spanStart);
+        spanStart = traceBegin();
         parse (input, arguments);
+        traceEnd(TRACE_PARSE, spanStart);
         if (arguments[0] == NULL) {
             continue;
         }
@@ -55,6 +80,7 @@ int main() {
             //Check if there's more than 1 arguments
             if (arguments[1] != NULL) {
                 printf("Too many arguments for history invocation\n");
+                lastExitStatus = 1;
                 continue;
             }
             //Repeat last command
@@ -70,6 +96,7 @@ int main() {
             //Save the command to history
             //Ensure we're not going to save an empty line
             if (arguments[0] != NULL) {
+                spanStart = traceBegin();
                 char joinedArguments[MAX_INPUT_SIZE] = {'\0'};
                 char *tempArguments[MAX_ARGUMENTS];
                 parse(unAliasedInput, tempArguments);
@@ -77,8 +104,18 @@ int main() {
 
                 saveCommand(joinedArguments, history, historyCount);
                 historyCount++;
+                traceEnd(TRACE_HISTORY, spanStart);
+            }
+            //Variables are expanded after saving, so history keeps the $ words
+            char expansionStorage[MAX_INPUT_SIZE * 4];
+            if (!expandCommandArguments(arguments, expansionStorage, sizeof(expansionStorage))) {
+                printf("Too many arguments for %s\n", arguments[0]);
+                lastExitStatus = 1;
+                continue;
             }
+            spanStart = traceBegin();
             executeCommand(arguments, history);
+            traceEnd(TRACE_COMMAND, spanStart);
         }
     }
     return 0;
@@ -88,11 +125,12 @@ int main() {
  *  Gets input from the user
  */
 void getInput(char *input, historyCommand *history) {
-    printf("> ");
+    printPrompt();
     //Checking if CTRL+D is pressed and handle exitShell
     if(fgets(input, MAX_INPUT_SIZE, stdin) == NULL) {
         exitShell(history);
     }
+    promptInputDone();
 }
 
 /*
@@ -125,9 +163,13 @@ void executeCommand(char **arguments, historyCommand* history) {
     //Ensure we're not dereferencing a null pointer
     if(arguments[0] == NULL){
         return;
-    } else if(strcmp("exit", command) == 0) {
+    }
+    //Internal commands succeed unless they say otherwise
+    lastExitStatus = 0;
+    if(strcmp("exit", command) == 0) {
         if (arguments[1] != NULL) {
             printf("Too many arguments for exit\n");
+            lastExitStatus = 1;
             return;
         }
         exitShell(history);
@@ -137,6 +179,8 @@ void executeCommand(char **arguments, historyCommand* history) {
         setPath(arguments);
     } else if(strcmp("cd", command) == 0) {
         changeDirectory(arguments);
+    } else if(strcmp("dirs", command) == 0) {
+        directoriesCommand(arguments);
     } else if(strcmp("history", command) == 0) {
         printHistory(arguments, history);
     } else if(strcmp("alias", command) == 0) {
@@ -148,6 +192,23 @@ void executeCommand(char **arguments, historyCommand* history) {
         }
     } else if(strcmp("unalias", command) == 0) {
         removeAlias(arguments);
+    } else if(strcmp("prompt", command) == 0) {
+        promptCommand(arguments);
+    } else if(strcmp("export", command) == 0) {
+        exportCommand(arguments);
+    } else if(strcmp("source", command) == 0) {
+        sourceCommand(arguments, history);
+    } else if(strcmp("trace", command) == 0) {
+        traceCommand(arguments);
+    } else if(strcmp("cache", command) == 0) {
+        cacheCommand(arguments);
+    } else if(strcmp("limit", command) == 0) {
+        limitCommand(arguments);
+    } else if(isFunction(command)) {
+        callFunction(arguments, history);
+    } else if(hasLimits(&sessionLimits)) {
+        //Non internal command, run under the limits set for the session
+        runLimited(arguments, &sessionLimits);
     } else {
         //Non internal command 
         execute(arguments);
@@ -158,25 +219,76 @@ void executeCommand(char **arguments, historyCommand* history) {
  *  Creates a child process, and executes the given command 
  */
 void execute(char **arguments) {
+    //When tracing, search the PATH here so the lookup shows up as its own span
+    char path[MAX_INPUT_SIZE * 2];
+    bool resolved = false;
+    uint64_t spanStart = traceBegin();
+    if (spanStart != 0) {
+        resolved = lookupCommand(arguments[0], path);
+        traceEnd(TRACE_LOOKUP, spanStart);
+    }
+
+    //Flush so the child does not inherit and repeat buffered output
+    fflush(stdout);
+    spanStart = traceBegin();
     pid_t pid = fork();
     if (pid < 0) {
         //Error if pid < 0
         printf("Error forking\n");
     } else if (pid > 0) {
         //Parent process
-        wait(NULL);
+        traceEnd(TRACE_FORK, spanStart);
+        spanStart = traceBegin();
+        int status;
+        waitpid(pid, &status, 0);
+        lastExitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        traceEnd(TRACE_WAIT, spanStart);
     } else {
         //Child process
+        if (resolved) {
+            execv(path, arguments);
+        }
         //Use execvp so we can pass arguments, and it checks the PATH
         if (execvp(arguments[0], arguments) < 0) {
 	    perror(arguments[0]);
         }
         //Just incase
-        exit(0);
+        exit(127);
     }
 }
 
 
+/*
+ * Searches the PATH for an executable called command, storing its full path in path
+ * Returns false if it was not found
+ */
+bool lookupCommand(char *command, char *path) {
+    char *searchPath = getenv("PATH");
+    if (strchr(command, '/') != NULL || searchPath == NULL) {
+        return false;
+    }
+    while (true) {
+        size_t length = strcspn(searchPath, ":");
+        if (length + strlen(command) + 3 <= MAX_INPUT_SIZE * 2) {
+            //An empty entry means the current directory, as it does for execvp
+            if (length == 0) {
+                snprintf(path, MAX_INPUT_SIZE * 2, "./%s", command);
+            } else {
+                snprintf(path, MAX_INPUT_SIZE * 2, "%.*s/%s", (int)length, searchPath, command);
+            }
+            if (access(path, X_OK) == 0) {
+                return true;
+            }
+        }
+        //A trailing : is an empty entry too, so stop only at the end of the string
+        if (searchPath[length] == '\0') {
+            break;
+        }
+        searchPath += length + 1;
+    }
+    return false;
+}
+
 /*
  * Iterates through a given string to see if the string is a number.
  * Returns 1 if string is a number, 0 otherwise. 
@@ -201,8 +313,18 @@ int isStringNumber(char *string) {
 void executeHistoryCommand(char **arguments, historyCommand* history, int historyNumber) {
     char temp[MAX_INPUT_SIZE];
     strcpy(temp, history[historyNumber].command);
+    if (isScriptStart(temp)) {
+        runScriptText(temp, history);
+        return;
+    }
     replaceAlias(temp);
     parse(temp, arguments);
+    char expansionStorage[MAX_INPUT_SIZE * 4];
+    if (!expandCommandArguments(arguments, expansionStorage, sizeof(expansionStorage))) {
+        printf("Too many arguments for %s\n", arguments[0]);
+        lastExitStatus = 1;
+        return;
+    }
     executeCommand(arguments, history);
 }
 
@@ -212,6 +334,7 @@ void executeHistoryCommand(char **arguments, historyCommand* history, int histor
 void repeatLastCommand(char **arguments, historyCommand *history, int historyCount) {
     if (historyCount == 0) {
         printf("History is empty\n");
+        lastExitStatus = 1;
         return;
     }
     if (historyCount > MAX_HISTORY_COUNT - 1) {
@@ -238,6 +361,7 @@ void repeatPastCommand(char **arguments, historyCommand *history, int historyCou
 
     if (!isANumber) {
         printf("Argument is not a number\n");
+        lastExitStatus = 1;
         return;
     }
     char numberString[MAX_INPUT_SIZE] = {'\0'};
@@ -249,12 +373,14 @@ void repeatPastCommand(char **arguments, historyCommand *history, int historyCou
 
     if (number == 0) {
         printf("Invalid number for history\n");
+        lastExitStatus = 1;
         return;
     }
     
     //Make sure entered number is not greater than current history
     if ((abs(number)) > MAX_HISTORY_COUNT || abs(number) > historyCount ) {
         printf("Not enough history\n");
+        lastExitStatus = 1;
         return;
     }
     if (number > 0) {
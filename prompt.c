@@ -0,0 +1,352 @@
+#include <sys/stat.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "prompt.h"
+
+static char *promptFormat = NULL;
+
+//Shared with the segment thread, guarded by promptLock
+static pthread_mutex_t promptLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requestReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t segmentsReady = PTHREAD_COND_INITIALIZER;
+static bool workerStarted = false;
+static unsigned long requestNumber = 0;
+static unsigned long finishedNumber = 0;
+static char requestCwd[MAX_INPUT_SIZE];
+static int requestStatus = 0;
+static bool waitingForInput = false;
+static bool shownStale = false;
+static long long promptShownAt = 0;
+static size_t shownLength = 0;
+static promptCacheEntry promptCache[MAX_PROMPT_CACHE];
+static unsigned long promptCacheClock = 0;
+
+/*
+ *  Returns the monotonic clock in milliseconds
+ */
+static long long nowMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ *  Returns the modification time of path in nanoseconds, or -1 if it does not exist
+ */
+static long long getModified(char *path) {
+    struct stat info;
+    if (stat(path, &info) < 0) {
+        return -1;
+    }
+    return (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+}
+
+static char *getPromptFormat() {
+    if (promptFormat == NULL) {
+        char *configured = getenv(PROMPT_ENV);
+        promptFormat = strdup(configured != NULL ? configured : DEFAULT_PROMPT);
+    }
+    return promptFormat;
+}
+
+/*
+ *  Expands the prompt format into out
+ *  %d working directory, %s last exit status, %b VCS branch, %% a percent sign
+ *  %_ a space and %g a > sign, which the prompt builtin cannot be given directly
+ *  A NULL branch means it is not known yet, a stale branch is marked with ?
+ */
+static void renderPrompt(char *out, size_t size, char *cwd, int status, char *branch, bool stale) {
+    char *format = getPromptFormat();
+    char *home = getenv("HOME");
+    size_t length = 0;
+    out[0] = '\0';
+
+    for (char *c = format; *c != '\0' && length + 1 < size; c++) {
+        if (*c != '%' || c[1] == '\0') {
+            out[length++] = *c;
+            out[length] = '\0';
+            continue;
+        }
+        c++;
+        switch (*c) {
+            case 'd':
+                //Shorten the home directory to ~
+                if (home != NULL && home[0] != '\0' && strncmp(cwd, home, strlen(home)) == 0
+                    && (cwd[strlen(home)] == '/' || cwd[strlen(home)] == '\0')) {
+                    snprintf(out + length, size - length, "~%s", cwd + strlen(home));
+                } else {
+                    snprintf(out + length, size - length, "%s", cwd);
+                }
+                break;
+            case 's':
+                snprintf(out + length, size - length, "%d", status);
+                break;
+            case 'b':
+                if (branch == NULL) {
+                    snprintf(out + length, size - length, " (...)");
+                } else if (branch[0] != '\0') {
+                    snprintf(out + length, size - length, " (%s%s)", branch, stale ? "?" : "");
+                }
+                break;
+            case '_':
+                snprintf(out + length, size - length, " ");
+                break;
+            case 'g':
+                snprintf(out + length, size - length, ">");
+                break;
+            case '%':
+                snprintf(out + length, size - length, "%%");
+                break;
+            default:
+                snprintf(out + length, size - length, "%%%c", *c);
+                break;
+        }
+        length = strlen(out);
+    }
+}
+
+/*
+ *  Returns the cache entry for cwd, or NULL if there is none
+ *  Must be called with promptLock held
+ */
+static promptCacheEntry *findPromptCacheEntry(char *cwd) {
+    for (int i = 0; i < MAX_PROMPT_CACHE; i++) {
+        if (promptCache[i].lastUsed != 0 && strcmp(promptCache[i].cwd, cwd) == 0) {
+            return &promptCache[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Returns the entry for cwd, reusing the least recently used entry if there is none
+ *  Must be called with promptLock held
+ */
+static promptCacheEntry *claimPromptCacheEntry(char *cwd) {
+    promptCacheEntry *entry = findPromptCacheEntry(cwd);
+    if (entry == NULL) {
+        entry = &promptCache[0];
+        for (int i = 1; i < MAX_PROMPT_CACHE; i++) {
+            if (promptCache[i].lastUsed < entry->lastUsed) {
+                entry = &promptCache[i];
+            }
+        }
+        snprintf(entry->cwd, MAX_INPUT_SIZE, "%s", cwd);
+    }
+    entry->lastUsed = ++promptCacheClock;
+    return entry;
+}
+
+/*
+ *  Walks up from cwd looking for a git HEAD, storing its path and the branch it names
+ *  A detached HEAD gives the abbreviated commit instead
+ */
+static void findBranch(char *cwd, char *headPath, size_t headSize, char *branch, size_t branchSize) {
+    char directory[MAX_INPUT_SIZE];
+    snprintf(directory, sizeof(directory), "%s", cwd);
+    headPath[0] = '\0';
+    branch[0] = '\0';
+
+    while (true) {
+        snprintf(headPath, headSize, "%s/.git/HEAD", strcmp(directory, "/") == 0 ? "" : directory);
+        FILE *file = fopen(headPath, "r");
+        if (file != NULL) {
+            char line[MAX_INPUT_SIZE] = {'\0'};
+            if (fgets(line, sizeof(line), file) != NULL) {
+                line[strcspn(line, "\n")] = '\0';
+                if (strncmp(line, "ref: refs/heads/", 16) == 0) {
+                    snprintf(branch, branchSize, "%s", line + 16);
+                } else {
+                    snprintf(branch, branchSize, "%.7s", line);
+                }
+            }
+            fclose(file);
+            return;
+        }
+        char *slash = strrchr(directory, '/');
+        if (slash == NULL || strcmp(directory, "/") == 0) {
+            break;
+        }
+        if (slash == directory) {
+            slash[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+    headPath[0] = '\0';
+}
+
+/*
+ *  Returns true if there is input waiting to be read from stdin
+ */
+static bool inputPending() {
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    return poll(&input, 1, 0) > 0;
+}
+
+/*
+ *  Background thread computing the expensive prompt segments
+ *  A cached branch is reused while the directory and HEAD modification times are unchanged
+ */
+static void *segmentWorker(void *unused) {
+    (void)unused;
+    char cwd[MAX_INPUT_SIZE];
+    char headPath[MAX_INPUT_SIZE + 16];
+    char branch[MAX_INPUT_SIZE];
+
+    while (true) {
+        pthread_mutex_lock(&promptLock);
+        while (finishedNumber == requestNumber) {
+            pthread_cond_wait(&requestReady, &promptLock);
+        }
+        unsigned long number = requestNumber;
+        snprintf(cwd, sizeof(cwd), "%s", requestCwd);
+        promptCacheEntry *entry = findPromptCacheEntry(cwd);
+        bool cached = entry != NULL;
+        long long cachedCwdModified = cached ? entry->cwdModified : 0;
+        long long cachedHeadModified = cached ? entry->headModified : 0;
+        snprintf(headPath, sizeof(headPath), "%s", cached ? entry->headPath : "");
+        pthread_mutex_unlock(&promptLock);
+
+        //The slow filesystem work happens without the lock
+        long long cwdModified = getModified(cwd);
+        long long headModified = headPath[0] != '\0' ? getModified(headPath) : -1;
+        bool valid = cached && cwdModified == cachedCwdModified && headModified == cachedHeadModified;
+        if (!valid) {
+            findBranch(cwd, headPath, sizeof(headPath), branch, sizeof(branch));
+            headModified = headPath[0] != '\0' ? getModified(headPath) : -1;
+        }
+
+        char prompt[MAX_INPUT_SIZE * 2];
+        char line[MAX_INPUT_SIZE * 4 + 16];
+        int lineLength = 0;
+        pthread_mutex_lock(&promptLock);
+        entry = claimPromptCacheEntry(cwd);
+        if (!valid) {
+            entry->cwdModified = cwdModified;
+            entry->headModified = headModified;
+            snprintf(entry->headPath, sizeof(entry->headPath), "%s", headPath);
+            snprintf(entry->branch, sizeof(entry->branch), "%s", branch);
+        }
+        finishedNumber = number;
+        pthread_cond_broadcast(&segmentsReady);
+        //Redraw a stale prompt if the user has probably not started typing yet
+        //Input already waiting on stdin would be wiped from the screen, so leave it alone
+        if (waitingForInput && shownStale && number == requestNumber
+            && nowMillis() - promptShownAt < PROMPT_REPAINT_MILLIS && !inputPending()) {
+            renderPrompt(prompt, sizeof(prompt), cwd, requestStatus, entry->branch, false);
+            size_t length = strlen(prompt);
+            if (length <= shownLength) {
+                //A terminal only hands over a partly typed line once it is finished, so it
+                //cannot be moved. Draw over the old prompt only and put the cursor back
+                lineLength = snprintf(line, sizeof(line), "\0337\r%s%*s\0338", prompt, (int)(shownLength - length), "");
+                shownStale = false;
+            } else if (!isatty(STDIN_FILENO)) {
+                //Nobody is typing at a terminal, so the line can be cleared for the longer prompt
+                lineLength = snprintf(line, sizeof(line), "\r\033[K%s", prompt);
+                shownStale = false;
+            }
+        }
+        pthread_mutex_unlock(&promptLock);
+
+        if (lineLength > 0) {
+            write(STDOUT_FILENO, line, lineLength);
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Prints the prompt. Segments that are not fresh within PROMPT_WAIT_MILLIS
+ *  are shown from the cache and marked stale, and repainted when ready
+ */
+void printPrompt() {
+    char prompt[MAX_INPUT_SIZE * 2];
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        cwd = strdup("?");
+    }
+
+    //Only the branch needs the background thread
+    if (strstr(getPromptFormat(), "%b") == NULL) {
+        renderPrompt(prompt, sizeof(prompt), cwd, lastExitStatus, "", false);
+        printf("%s", prompt);
+        fflush(stdout);
+        free(cwd);
+        return;
+    }
+
+    pthread_mutex_lock(&promptLock);
+    if (!workerStarted) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, segmentWorker, NULL) == 0) {
+            pthread_detach(worker);
+            workerStarted = true;
+        }
+    }
+    bool fresh = false;
+    if (workerStarted) {
+        snprintf(requestCwd, sizeof(requestCwd), "%s", cwd);
+        requestStatus = lastExitStatus;
+        unsigned long number = ++requestNumber;
+        pthread_cond_signal(&requestReady);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PROMPT_WAIT_MILLIS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (finishedNumber < number) {
+            if (pthread_cond_timedwait(&segmentsReady, &promptLock, &deadline) != 0) {
+                break;
+            }
+        }
+        fresh = finishedNumber >= number;
+    }
+    promptCacheEntry *entry = findPromptCacheEntry(cwd);
+    renderPrompt(prompt, sizeof(prompt), cwd, lastExitStatus, entry == NULL ? NULL : entry->branch, !fresh);
+    waitingForInput = true;
+    shownStale = !fresh && isatty(STDOUT_FILENO);
+    promptShownAt = nowMillis();
+    shownLength = strlen(prompt);
+    //Print under the lock so a repaint cannot come before the prompt
+    printf("%s", prompt);
+    fflush(stdout);
+    pthread_mutex_unlock(&promptLock);
+    free(cwd);
+}
+
+/*
+ *  Stops the prompt from being repainted once a line has been read
+ */
+void promptInputDone() {
+    pthread_mutex_lock(&promptLock);
+    waitingForInput = false;
+    pthread_mutex_unlock(&promptLock);
+}
+
+/*
+ *  Built-in command that prints or sets the prompt format
+ */
+void promptCommand(char **arguments) {
+    if (arguments[1] == NULL) {
+        printf("Prompt: %s\n", getPromptFormat());
+        printf("%%d directory, %%s last exit status, %%b VCS branch, %%%% percent sign\n");
+        printf("%%_ space, %%g > sign, for the characters a command line drops\n");
+        return;
+    }
+    char format[MAX_INPUT_SIZE] = {'\0'};
+    //Join the words back together, keeping a space before the input
+    for (int i = 1; arguments[i] != NULL; i++) {
+        strncat(format, arguments[i], MAX_INPUT_SIZE - strlen(format) - 2);
+        strcat(format, " ");
+    }
+    pthread_mutex_lock(&promptLock);
+    free(promptFormat);
+    promptFormat = strdup(format);
+    pthread_mutex_unlock(&promptLock);
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "common.h"
+
+#define PROMPT_ENV "SHELL_PROMPT"
+#define DEFAULT_PROMPT "[%s] %d%b> "
+#define MAX_PROMPT_CACHE 16
+//How long the prompt waits for fresh segments before showing stale ones
+#define PROMPT_WAIT_MILLIS 10
+//Fresh segments only repaint the prompt this soon after it was shown, so typed text is not drawn over
+#define PROMPT_REPAINT_MILLIS 250
+
+struct promptCacheEntry {
+    char cwd[MAX_INPUT_SIZE];
+    long long cwdModified;
+    char headPath[MAX_INPUT_SIZE + 16];
+    long long headModified;
+    char branch[MAX_INPUT_SIZE];
+    unsigned long lastUsed;
+} typedef promptCacheEntry;
+
+void printPrompt();
+void promptInputDone();
+void promptCommand(char **arguments);
@@ -0,0 +1,1142 @@
+#include <sys/stat.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "script.h"
+#include "cache.h"
+
+enum controlFlow {
+    CONTROL_NONE,
+    CONTROL_BREAK,
+    CONTROL_CONTINUE,
+    CONTROL_RETURN
+} typedef controlFlow;
+
+static controlFlow pendingControl = CONTROL_NONE;
+static int loopDepth = 0;
+static int callDepth = 0;
+static char **positional = NULL;
+static int positionalCount = 0;
+static compiledScript *runningScript = NULL;
+
+static scriptVariable variables[MAX_VARIABLES];
+static int variableCount = 0;
+static scriptFunction functions[MAX_FUNCTIONS];
+static compiledScript *scriptCache[MAX_CACHED_SCRIPTS];
+static unsigned long cacheClock = 0;
+
+//Same delimiters as parse(), minus the separators the scripts give meaning to
+static const char whitespace[] = " \t\r<>|&";
+static const char wordEnds[] = " \t\r<>|&\n;()";
+
+static const char *reservedWords[] = {"then", "elif", "else", "fi", "do", "done", "{", "}", NULL};
+
+static void runNode(scriptNode *node, historyCommand *history);
+
+/*
+ *  Splits the text into tokens, returning an array ending with a TOKEN_END token
+ *  Caller must free the tokens with freeTokens
+ */
+static scriptToken *tokenize(char *text) {
+    int count = 0;
+    int capacity = 64;
+    scriptToken *tokens = malloc(capacity * sizeof(scriptToken));
+    char *c = text;
+
+    while (true) {
+        if (count == capacity) {
+            capacity *= 2;
+            tokens = realloc(tokens, capacity * sizeof(scriptToken));
+        }
+        while (*c != '\0' && strchr(whitespace, *c) != NULL) {
+            c++;
+        }
+        if (*c == '\0') {
+            tokens[count++] = (scriptToken){TOKEN_END, NULL};
+            return tokens;
+        }
+        if (*c == '#') {
+            //Comment until the end of the line
+            while (*c != '\0' && *c != '\n') {
+                c++;
+            }
+        } else if (*c == '\n' || *c == ';') {
+            tokens[count++] = (scriptToken){TOKEN_SEPARATOR, NULL};
+            c++;
+        } else if (*c == '(') {
+            tokens[count++] = (scriptToken){TOKEN_OPEN_PAREN, NULL};
+            c++;
+        } else if (*c == ')') {
+            tokens[count++] = (scriptToken){TOKEN_CLOSE_PAREN, NULL};
+            c++;
+        } else {
+            char *start = c;
+            while (*c != '\0' && strchr(wordEnds, *c) == NULL) {
+                c++;
+            }
+            tokens[count++] = (scriptToken){TOKEN_WORD, strndup(start, c - start)};
+        }
+    }
+}
+
+static void freeTokens(scriptToken *tokens) {
+    for (int i = 0; tokens[i].type != TOKEN_END; i++) {
+        free(tokens[i].text);
+    }
+    free(tokens);
+}
+
+static scriptNode *newNode(nodeType type) {
+    scriptNode *node = calloc(1, sizeof(scriptNode));
+    node->type = type;
+    return node;
+}
+
+static void freeNode(scriptNode *node) {
+    if (node == NULL) {
+        return;
+    }
+    for (int i = 0; i < node->wordCount; i++) {
+        free(node->words[i]);
+    }
+    free(node->words);
+    free(node->needsExpansion);
+    free(node->name);
+    freeNode(node->condition);
+    freeNode(node->body);
+    freeNode(node->elseBody);
+    for (int i = 0; i < node->childCount; i++) {
+        freeNode(node->children[i]);
+    }
+    free(node->children);
+    free(node);
+}
+
+static void addWord(scriptNode *node, char *word) {
+    node->words = realloc(node->words, (node->wordCount + 1) * sizeof(char *));
+    node->needsExpansion = realloc(node->needsExpansion, (node->wordCount + 1) * sizeof(bool));
+    node->words[node->wordCount] = strdup(word);
+    node->needsExpansion[node->wordCount] = strchr(word, '$') != NULL;
+    node->wordCount++;
+}
+
+static void addChild(scriptNode *node, scriptNode *child) {
+    node->children = realloc(node->children, (node->childCount + 1) * sizeof(scriptNode *));
+    node->children[node->childCount++] = child;
+}
+
+/*
+ *  Returns true if word is a valid variable or function name
+ */
+static bool isName(char *word, size_t length) {
+    if (length == 0 || !(isalpha(word[0]) || word[0] == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < length; i++) {
+        if (!(isalnum(word[i]) || word[i] == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ *  Returns true if word has the form NAME=value
+ */
+static bool isAssignmentWord(char *word) {
+    char *equals = strchr(word, '=');
+    return equals != NULL && isName(word, equals - word);
+}
+
+static bool isInList(char *word, const char **list) {
+    for (int i = 0; list != NULL && list[i] != NULL; i++) {
+        if (strcmp(word, list[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static scriptToken *peek(scriptParser *parser) {
+    return &parser->tokens[parser->position];
+}
+
+static void advance(scriptParser *parser) {
+    if (peek(parser)->type != TOKEN_END) {
+        parser->position++;
+    }
+}
+
+static bool atWord(scriptParser *parser, char *word) {
+    return peek(parser)->type == TOKEN_WORD && strcmp(peek(parser)->text, word) == 0;
+}
+
+static void skipSeparators(scriptParser *parser) {
+    while (peek(parser)->type == TOKEN_SEPARATOR) {
+        advance(parser);
+    }
+}
+
+/*
+ *  Marks the parse as failed. Running out of input only means more lines are needed
+ */
+static void fail(scriptParser *parser, char *expected) {
+    if (parser->status != PARSE_OK) {
+        return;
+    }
+    scriptToken *token = peek(parser);
+    if (token->type == TOKEN_END) {
+        parser->status = PARSE_INCOMPLETE;
+        return;
+    }
+    parser->status = PARSE_ERROR;
+    if (token->type == TOKEN_WORD) {
+        printf("Syntax error: expected %s but found %s\n", expected, token->text);
+    } else if (token->type == TOKEN_SEPARATOR) {
+        printf("Syntax error: expected %s but found end of command\n", expected);
+    } else {
+        printf("Syntax error: expected %s but found %c\n", expected, token->type == TOKEN_OPEN_PAREN ? '(' : ')');
+    }
+}
+
+static bool expectWord(scriptParser *parser, char *word) {
+    if (!atWord(parser, word)) {
+        fail(parser, word);
+        return false;
+    }
+    advance(parser);
+    return true;
+}
+
+static scriptNode *parseCommand(scriptParser *parser);
+
+/*
+ *  Parses commands until one of the terminators is found in command position
+ *  A NULL terminators list parses until the end of the input
+ */
+static scriptNode *parseList(scriptParser *parser, const char **terminators) {
+    scriptNode *node = newNode(NODE_LIST);
+    while (parser->status == PARSE_OK) {
+        skipSeparators(parser);
+        scriptToken *token = peek(parser);
+        if (token->type == TOKEN_END) {
+            if (terminators != NULL) {
+                fail(parser, (char *)terminators[0]);
+            }
+            break;
+        }
+        if (token->type == TOKEN_WORD && isInList(token->text, terminators)) {
+            break;
+        }
+        scriptNode *child = parseCommand(parser);
+        if (child == NULL) {
+            break;
+        }
+        addChild(node, child);
+    }
+    return node;
+}
+
+/*
+ *  if list then list [elif list then list]... [else list] fi
+ */
+static scriptNode *parseIf(scriptParser *parser) {
+    static const char *thenWords[] = {"then", NULL};
+    static const char *bodyEnds[] = {"elif", "else", "fi", NULL};
+    static const char *elseEnds[] = {"fi", NULL};
+    scriptNode *node = newNode(NODE_IF);
+
+    //Skip the if, or the elif of a nested if
+    advance(parser);
+    node->condition = parseList(parser, thenWords);
+    if (!expectWord(parser, "then")) {
+        return node;
+    }
+    node->body = parseList(parser, bodyEnds);
+    if (atWord(parser, "elif")) {
+        //The nested if consumes the fi
+        node->elseBody = parseIf(parser);
+        return node;
+    }
+    if (atWord(parser, "else")) {
+        advance(parser);
+        node->elseBody = parseList(parser, elseEnds);
+    }
+    expectWord(parser, "fi");
+    return node;
+}
+
+/*
+ *  while list do list done, or until list do list done
+ */
+static scriptNode *parseWhile(scriptParser *parser) {
+    static const char *doWords[] = {"do", NULL};
+    static const char *doneWords[] = {"done", NULL};
+    scriptNode *node = newNode(NODE_WHILE);
+
+    node->negate = atWord(parser, "until");
+    advance(parser);
+    node->condition = parseList(parser, doWords);
+    if (!expectWord(parser, "do")) {
+        return node;
+    }
+    node->body = parseList(parser, doneWords);
+    expectWord(parser, "done");
+    return node;
+}
+
+/*
+ *  for name [in words...] do list done
+ *  Without in the loop goes over the positional parameters
+ */
+static scriptNode *parseFor(scriptParser *parser) {
+    static const char *doneWords[] = {"done", NULL};
+    scriptNode *node = newNode(NODE_FOR);
+
+    advance(parser);
+    scriptToken *token = peek(parser);
+    if (token->type != TOKEN_WORD || !isName(token->text, strlen(token->text))) {
+        fail(parser, "a variable name");
+        return node;
+    }
+    node->name = strdup(token->text);
+    advance(parser);
+
+    if (atWord(parser, "in")) {
+        advance(parser);
+        node->hasList = true;
+        while (peek(parser)->type == TOKEN_WORD) {
+            addWord(node, peek(parser)->text);
+            advance(parser);
+        }
+    }
+    skipSeparators(parser);
+    if (!expectWord(parser, "do")) {
+        return node;
+    }
+    node->body = parseList(parser, doneWords);
+    expectWord(parser, "done");
+    return node;
+}
+
+/*
+ *  name() { list }, or function name [()] { list }
+ */
+static scriptNode *parseFunction(scriptParser *parser, bool hasKeyword) {
+    static const char *braceWords[] = {"}", NULL};
+    scriptNode *node = newNode(NODE_FUNCTION);
+
+    if (hasKeyword) {
+        advance(parser);
+    }
+    scriptToken *token = peek(parser);
+    if (token->type != TOKEN_WORD || !isName(token->text, strlen(token->text))) {
+        fail(parser, "a function name");
+        return node;
+    }
+    node->name = strdup(token->text);
+    advance(parser);
+
+    if (peek(parser)->type == TOKEN_OPEN_PAREN) {
+        advance(parser);
+        if (peek(parser)->type != TOKEN_CLOSE_PAREN) {
+            fail(parser, ")");
+            return node;
+        }
+        advance(parser);
+    }
+    skipSeparators(parser);
+    if (!expectWord(parser, "{")) {
+        return node;
+    }
+    node->body = parseList(parser, braceWords);
+    expectWord(parser, "}");
+    return node;
+}
+
+/*
+ *  A command and its arguments, or a list of NAME=value assignments
+ */
+static scriptNode *parseSimpleCommand(scriptParser *parser) {
+    scriptNode *node = newNode(NODE_COMMAND);
+    node->isAssignment = true;
+    while (peek(parser)->type == TOKEN_WORD) {
+        addWord(node, peek(parser)->text);
+        node->isAssignment = node->isAssignment && isAssignmentWord(peek(parser)->text);
+        advance(parser);
+    }
+    return node;
+}
+
+static scriptNode *parseCommand(scriptParser *parser) {
+    scriptToken *token = peek(parser);
+    if (token->type != TOKEN_WORD) {
+        fail(parser, "a command");
+        return NULL;
+    }
+    if (strcmp(token->text, "if") == 0) {
+        return parseIf(parser);
+    } else if (strcmp(token->text, "while") == 0 || strcmp(token->text, "until") == 0) {
+        return parseWhile(parser);
+    } else if (strcmp(token->text, "for") == 0) {
+        return parseFor(parser);
+    } else if (strcmp(token->text, "function") == 0) {
+        return parseFunction(parser, true);
+    } else if (parser->tokens[parser->position + 1].type == TOKEN_OPEN_PAREN) {
+        return parseFunction(parser, false);
+    } else if (isInList(token->text, reservedWords)) {
+        fail(parser, "a command");
+        return NULL;
+    }
+    return parseSimpleCommand(parser);
+}
+
+/*
+ *  Compiles the text into a tree of nodes, stored in root even if compiling failed
+ */
+static parseStatus compileScript(char *text, scriptNode **root) {
+    scriptParser parser = {tokenize(text), 0, PARSE_OK};
+    *root = parseList(&parser, NULL);
+    freeTokens(parser.tokens);
+    return parser.status;
+}
+
+static scriptVariable *findVariable(char *name) {
+    for (int i = 0; i < variableCount; i++) {
+        if (strcmp(variables[i].name, name) == 0) {
+            return &variables[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Sets a shell variable. It is not seen by commands until it is exported,
+ *  so names such as PATH and HOME do not change how the shell runs commands
+ */
+static void setVariable(char *name, char *value) {
+    scriptVariable *variable = findVariable(name);
+    if (variable == NULL) {
+        if (variableCount >= MAX_VARIABLES) {
+            printf("No more space for variables\n");
+            lastExitStatus = 1;
+            return;
+        }
+        variable = &variables[variableCount++];
+        snprintf(variable->name, MAX_INPUT_SIZE, "%s", name);
+    }
+    snprintf(variable->value, MAX_INPUT_SIZE, "%s", value);
+}
+
+/*
+ *  Built-in command copying shell variables into the environment
+ *  export NAME sets it to the shell variable's value, export NAME=value sets both
+ */
+void exportCommand(char **arguments) {
+    if (arguments[1] == NULL) {
+        printf("export requires a variable name\n");
+        lastExitStatus = 1;
+        return;
+    }
+    for (int i = 1; arguments[i] != NULL; i++) {
+        char name[MAX_INPUT_SIZE];
+        char *equals = strchr(arguments[i], '=');
+        size_t length = equals == NULL ? strlen(arguments[i]) : (size_t)(equals - arguments[i]);
+        if (!isName(arguments[i], length)) {
+            printf("Invalid variable name for export: %s\n", arguments[i]);
+            lastExitStatus = 1;
+            continue;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)length, arguments[i]);
+        if (equals != NULL) {
+            setVariable(name, equals + 1);
+        }
+        scriptVariable *variable = findVariable(name);
+        if (variable != NULL) {
+            setenv(name, variable->value, 1);
+        }
+    }
+}
+
+/*
+ *  Looks up a variable: $?, $#, a positional parameter, a shell variable or an environment variable
+ *  Numbers are formatted into buffer
+ */
+static char *lookupVariable(char *name, char *buffer, size_t size) {
+    if (strcmp(name, "?") == 0) {
+        snprintf(buffer, size, "%d", lastExitStatus);
+        return buffer;
+    }
+    if (strcmp(name, "#") == 0) {
+        snprintf(buffer, size, "%d", positionalCount);
+        return buffer;
+    }
+    if (isdigit(name[0])) {
+        int index = atoi(name);
+        if (index == 0) {
+            return "shell";
+        }
+        return index <= positionalCount ? positional[index - 1] : "";
+    }
+    scriptVariable *variable = findVariable(name);
+    if (variable != NULL) {
+        return variable->value;
+    }
+    char *value = getenv(name);
+    return value == NULL ? "" : value;
+}
+
+/*
+ *  Replaces $name, ${name}, $1 to $9, $# and $? in word, writing the result to out
+ */
+static void expandWord(char *word, char *out, size_t size) {
+    size_t length = 0;
+    char name[MAX_INPUT_SIZE];
+    char number[32];
+    char *c = word;
+
+    while (*c != '\0') {
+        char *value = NULL;
+        if (*c != '$') {
+            if (length + 1 < size) {
+                out[length++] = *c;
+            }
+            c++;
+            continue;
+        }
+        c++;
+        if (*c == '?' || *c == '#' || isdigit(*c)) {
+            name[0] = *c;
+            name[1] = '\0';
+            c++;
+            value = lookupVariable(name, number, sizeof(number));
+        } else if (*c == '{' && strchr(c, '}') != NULL) {
+            char *end = strchr(c, '}');
+            snprintf(name, sizeof(name), "%.*s", (int)(end - c - 1), c + 1);
+            c = end + 1;
+            value = lookupVariable(name, number, sizeof(number));
+        } else if (isalpha(*c) || *c == '_') {
+            size_t nameLength = 0;
+            while ((isalnum(*c) || *c == '_') && nameLength + 1 < sizeof(name)) {
+                name[nameLength++] = *c++;
+            }
+            name[nameLength] = '\0';
+            value = lookupVariable(name, number, sizeof(number));
+        } else {
+            //A lone $ is kept as it is
+            value = "$";
+        }
+        while (*value != '\0' && length + 1 < size) {
+            out[length++] = *value++;
+        }
+    }
+    out[length] = '\0';
+}
+
+/*
+ *  Builds the argument list for words, expanding the words that need it and
+ *  splitting the expansions on whitespace. Expanded text is kept in storage
+ *  Returns the number of arguments, or -1 if they did not fit
+ */
+static int expandArguments(char **words, bool *needsExpansion, int wordCount, char **arguments, char *storage, size_t storageSize) {
+    int count = 0;
+    size_t used = 0;
+    char expanded[MAX_INPUT_SIZE];
+
+    for (int i = 0; i < wordCount; i++) {
+        if (!needsExpansion[i]) {
+            if (count >= MAX_SCRIPT_ARGUMENTS) {
+                return -1;
+            }
+            arguments[count++] = words[i];
+            continue;
+        }
+        expandWord(words[i], expanded, sizeof(expanded));
+        char *savePointer;
+        char *field = strtok_r(expanded, " \t\n", &savePointer);
+        while (field != NULL) {
+            size_t length = strlen(field) + 1;
+            if (count >= MAX_SCRIPT_ARGUMENTS || used + length > storageSize) {
+                return -1;
+            }
+            memcpy(storage + used, field, length);
+            arguments[count++] = storage + used;
+            used += length;
+            field = strtok_r(NULL, " \t\n", &savePointer);
+        }
+    }
+    arguments[count] = NULL;
+    return count;
+}
+
+/*
+ *  Expands variables in the arguments of a command line typed at the prompt
+ *  Expanded text is kept in storage. Returns false if the arguments did not fit
+ */
+bool expandCommandArguments(char **arguments, char *storage, size_t storageSize) {
+    char *words[MAX_SCRIPT_ARGUMENTS];
+    bool needsExpansion[MAX_SCRIPT_ARGUMENTS];
+    int wordCount = 0;
+    for (; arguments[wordCount] != NULL; wordCount++) {
+        if (wordCount == MAX_SCRIPT_ARGUMENTS) {
+            return false;
+        }
+        words[wordCount] = arguments[wordCount];
+        needsExpansion[wordCount] = strchr(arguments[wordCount], '$') != NULL;
+    }
+    char *expanded[MAX_SCRIPT_ARGUMENTS + 1];
+    int count = expandArguments(words, needsExpansion, wordCount, expanded, storage, storageSize);
+    //The caller's list has room for MAX_SCRIPT_ARGUMENTS including the NULL
+    if (count < 0 || count >= MAX_SCRIPT_ARGUMENTS) {
+        return false;
+    }
+    memcpy(arguments, expanded, (count + 1) * sizeof(char *));
+    return true;
+}
+
+static void retainScript(compiledScript *script) {
+    script->refCount++;
+}
+
+static void releaseScript(compiledScript *script) {
+    script->refCount--;
+    if (script->refCount == 0) {
+        freeNode(script->root);
+        free(script->key);
+        free(script);
+    }
+}
+
+static scriptFunction *findFunction(char *name) {
+    for (int i = 0; i < MAX_FUNCTIONS; i++) {
+        if (functions[i].owner != NULL && strcmp(functions[i].name, name) == 0) {
+            return &functions[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Returns true if a function called name has been defined
+ */
+bool isFunction(char *name) {
+    return findFunction(name) != NULL;
+}
+
+/*
+ *  Stores the function, keeping the script its body belongs to alive
+ */
+static void defineFunction(char *name, scriptNode *body) {
+    scriptFunction *function = findFunction(name);
+    if (function == NULL) {
+        for (int i = 0; i < MAX_FUNCTIONS && function == NULL; i++) {
+            if (functions[i].owner == NULL) {
+                function = &functions[i];
+            }
+        }
+    }
+    if (function == NULL) {
+        printf("No more space for functions\n");
+        lastExitStatus = 1;
+        return;
+    }
+    //Retain first in case the function is being redefined by its own script
+    retainScript(runningScript);
+    if (function->owner != NULL) {
+        releaseScript(function->owner);
+    }
+    snprintf(function->name, MAX_INPUT_SIZE, "%s", name);
+    function->body = body;
+    function->owner = runningScript;
+    lastExitStatus = 0;
+}
+
+/*
+ *  Runs the function called arguments[0] with the rest of arguments as its parameters
+ */
+void callFunction(char **arguments, historyCommand *history) {
+    scriptFunction *function = findFunction(arguments[0]);
+    if (function == NULL) {
+        return;
+    }
+    if (callDepth >= MAX_CALL_DEPTH) {
+        printf("Too many nested function calls in %s\n", arguments[0]);
+        lastExitStatus = 1;
+        return;
+    }
+
+    char **savedPositional = positional;
+    int savedPositionalCount = positionalCount;
+    int savedLoopDepth = loopDepth;
+    compiledScript *savedScript = runningScript;
+    compiledScript *owner = function->owner;
+
+    positional = arguments + 1;
+    positionalCount = 0;
+    while (positional[positionalCount] != NULL) {
+        positionalCount++;
+    }
+    //The function may be redefined while it runs, so hold on to its body
+    retainScript(owner);
+    runningScript = owner;
+    loopDepth = 0;
+    callDepth++;
+
+    runNode(function->body, history);
+    if (pendingControl == CONTROL_RETURN) {
+        pendingControl = CONTROL_NONE;
+    }
+
+    callDepth--;
+    loopDepth = savedLoopDepth;
+    runningScript = savedScript;
+    positional = savedPositional;
+    positionalCount = savedPositionalCount;
+    releaseScript(owner);
+}
+
+/*
+ *  Runs a command node: assignments, break, continue and return are handled
+ *  here, everything else goes through executeCommand like typed commands do
+ */
+static void runSimpleCommand(scriptNode *node, historyCommand *history) {
+    char *arguments[MAX_SCRIPT_ARGUMENTS + 1];
+    char storage[MAX_INPUT_SIZE * 4];
+    char expanded[MAX_INPUT_SIZE];
+
+    if (node->isAssignment) {
+        for (int i = 0; i < node->wordCount; i++) {
+            char *equals = strchr(node->words[i], '=');
+            char name[MAX_INPUT_SIZE];
+            snprintf(name, sizeof(name), "%.*s", (int)(equals - node->words[i]), node->words[i]);
+            expandWord(equals + 1, expanded, sizeof(expanded));
+            setVariable(name, expanded);
+        }
+        lastExitStatus = 0;
+        return;
+    }
+
+    int count = expandArguments(node->words, node->needsExpansion, node->wordCount, arguments, storage, sizeof(storage));
+    if (count < 0) {
+        printf("Too many arguments for %s\n", node->words[0]);
+        lastExitStatus = 1;
+        return;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    if (strcmp(arguments[0], "break") == 0 || strcmp(arguments[0], "continue") == 0) {
+        if (loopDepth == 0) {
+            printf("%s is only valid inside a loop\n", arguments[0]);
+            lastExitStatus = 1;
+            return;
+        }
+        pendingControl = arguments[0][0] == 'b' ? CONTROL_BREAK : CONTROL_CONTINUE;
+        lastExitStatus = 0;
+    } else if (strcmp(arguments[0], "return") == 0) {
+        if (callDepth == 0) {
+            printf("return is only valid inside a function\n");
+            lastExitStatus = 1;
+            return;
+        }
+        if (arguments[1] != NULL) {
+            lastExitStatus = atoi(arguments[1]);
+        }
+        pendingControl = CONTROL_RETURN;
+    } else {
+        executeCommand(arguments, history);
+    }
+}
+
+/*
+ *  Runs the body while (or until) the condition succeeds
+ */
+static void runWhile(scriptNode *node, historyCommand *history) {
+    int status = 0;
+    loopDepth++;
+    while (true) {
+        runNode(node->condition, history);
+        if (pendingControl != CONTROL_NONE || (lastExitStatus == 0) == node->negate) {
+            break;
+        }
+        runNode(node->body, history);
+        status = lastExitStatus;
+        if (pendingControl == CONTROL_CONTINUE) {
+            pendingControl = CONTROL_NONE;
+        } else if (pendingControl != CONTROL_NONE) {
+            break;
+        }
+    }
+    loopDepth--;
+    if (pendingControl == CONTROL_RETURN) {
+        return;
+    }
+    pendingControl = CONTROL_NONE;
+    lastExitStatus = status;
+}
+
+/*
+ *  Runs the body once for every word, or every positional parameter
+ */
+static void runFor(scriptNode *node, historyCommand *history) {
+    char *values[MAX_SCRIPT_ARGUMENTS + 1];
+    char storage[MAX_INPUT_SIZE * 4];
+    int count;
+
+    if (node->hasList) {
+        count = expandArguments(node->words, node->needsExpansion, node->wordCount, values, storage, sizeof(storage));
+        if (count < 0) {
+            printf("Too many words for for %s\n", node->name);
+            lastExitStatus = 1;
+            return;
+        }
+    } else {
+        count = positionalCount < MAX_SCRIPT_ARGUMENTS ? positionalCount : MAX_SCRIPT_ARGUMENTS;
+        for (int i = 0; i < count; i++) {
+            values[i] = positional[i];
+        }
+    }
+
+    lastExitStatus = 0;
+    loopDepth++;
+    for (int i = 0; i < count; i++) {
+        setVariable(node->name, values[i]);
+        runNode(node->body, history);
+        if (pendingControl == CONTROL_CONTINUE) {
+            pendingControl = CONTROL_NONE;
+        } else if (pendingControl != CONTROL_NONE) {
+            break;
+        }
+    }
+    loopDepth--;
+    if (pendingControl == CONTROL_BREAK) {
+        pendingControl = CONTROL_NONE;
+    }
+}
+
+static void runNode(scriptNode *node, historyCommand *history) {
+    switch (node->type) {
+        case NODE_COMMAND:
+            runSimpleCommand(node, history);
+            break;
+        case NODE_LIST:
+            for (int i = 0; i < node->childCount && pendingControl == CONTROL_NONE; i++) {
+                runNode(node->children[i], history);
+            }
+            break;
+        case NODE_IF:
+            runNode(node->condition, history);
+            if (pendingControl != CONTROL_NONE) {
+                break;
+            }
+            if (lastExitStatus == 0) {
+                runNode(node->body, history);
+            } else if (node->elseBody != NULL) {
+                runNode(node->elseBody, history);
+            } else {
+                lastExitStatus = 0;
+            }
+            break;
+        case NODE_WHILE:
+            runWhile(node, history);
+            break;
+        case NODE_FOR:
+            runFor(node, history);
+            break;
+        case NODE_FUNCTION:
+            defineFunction(node->name, node->body);
+            break;
+    }
+}
+
+static void runCompiledScript(compiledScript *script, historyCommand *history) {
+    compiledScript *savedScript = runningScript;
+    retainScript(script);
+    runningScript = script;
+    runNode(script->root, history);
+    pendingControl = CONTROL_NONE;
+    runningScript = savedScript;
+    releaseScript(script);
+}
+
+static int findCachedScript(char *key, unsigned long long hash) {
+    for (int i = 0; i < MAX_CACHED_SCRIPTS; i++) {
+        if (scriptCache[i] != NULL && scriptCache[i]->hash == hash && strcmp(scriptCache[i]->key, key) == 0) {
+            scriptCache[i]->lastUsed = ++cacheClock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Adds the script to the cache, replacing the least recently used script if full
+ */
+static void cacheScript(compiledScript *script) {
+    int slot = 0;
+    for (int i = 0; i < MAX_CACHED_SCRIPTS; i++) {
+        if (scriptCache[i] == NULL) {
+            slot = i;
+            break;
+        }
+        if (scriptCache[i]->lastUsed < scriptCache[slot]->lastUsed) {
+            slot = i;
+        }
+    }
+    if (scriptCache[slot] != NULL) {
+        releaseScript(scriptCache[slot]);
+    }
+    script->lastUsed = ++cacheClock;
+    retainScript(script);
+    scriptCache[slot] = script;
+}
+
+/*
+ *  Returns the compiled script for key, compiling and caching text on a miss
+ *  Returns NULL and sets status if the text does not compile
+ */
+static compiledScript *getCompiledScript(char *key, char *text, long long size, long long modified, parseStatus *status) {
+    unsigned long long hash = hashCacheKey(key, strlen(key));
+    int index = findCachedScript(key, hash);
+    *status = PARSE_OK;
+    if (index >= 0) {
+        if (scriptCache[index]->size == size && scriptCache[index]->modified == modified) {
+            return scriptCache[index];
+        }
+        //The file changed since it was compiled
+        releaseScript(scriptCache[index]);
+        scriptCache[index] = NULL;
+    }
+    if (text == NULL) {
+        return NULL;
+    }
+
+    scriptNode *root;
+    *status = compileScript(text, &root);
+    if (*status != PARSE_OK) {
+        freeNode(root);
+        return NULL;
+    }
+    compiledScript *script = calloc(1, sizeof(compiledScript));
+    script->key = strdup(key);
+    script->hash = hash;
+    script->size = size;
+    script->modified = modified;
+    script->root = root;
+    cacheScript(script);
+    return script;
+}
+
+/*
+ *  Text scripts are keyed on their contents
+ */
+static compiledScript *getCompiledText(char *text, parseStatus *status) {
+    char key[MAX_SCRIPT_SIZE + 8];
+    snprintf(key, sizeof(key), "text:%s", text);
+    return getCompiledScript(key, text, 0, 0, status);
+}
+
+/*
+ *  Returns true if the input starts with control flow, a function definition
+ *  or a variable assignment, which the script interpreter runs instead of parse()
+ */
+bool isScriptStart(char *input) {
+    static const char *starters[] = {"if", "while", "until", "for", "function", NULL};
+    char word[MAX_INPUT_SIZE];
+    size_t length = 0;
+
+    while (*input != '\0' && strchr(whitespace, *input) != NULL) {
+        input++;
+    }
+    while (input[length] != '\0' && strchr(wordEnds, input[length]) == NULL && length + 1 < sizeof(word)) {
+        word[length] = input[length];
+        length++;
+    }
+    word[length] = '\0';
+    if (length == 0) {
+        return false;
+    }
+    if (isInList(word, starters) || isAssignmentWord(word)) {
+        return true;
+    }
+    //name() starts a function definition
+    input += length;
+    while (*input == ' ' || *input == '\t') {
+        input++;
+    }
+    return *input == '(' && isName(word, length);
+}
+
+/*
+ *  Joins the lines of a block into one history line, separated by ; and without comments
+ *  Returns false if the result does not fit in a history line
+ */
+static bool joinScriptLines(char *text, char *historyLine) {
+    char joined[MAX_SCRIPT_SIZE + MAX_SCRIPT_SIZE / 2];
+    size_t length = 0;
+    bool wordStart = true;
+
+    for (char *c = text; *c != '\0'; c++) {
+        if (*c == '#' && wordStart) {
+            //Comment until the end of the line, which would swallow the lines after it
+            while (c[1] != '\0' && c[1] != '\n') {
+                c++;
+            }
+        } else if (*c == '\n') {
+            //Blank lines and indentation are dropped, other lines end with a separator
+            while (length > 0 && strchr(" \t\r", joined[length - 1]) != NULL) {
+                length--;
+            }
+            if (length > 0 && joined[length - 1] != ';') {
+                joined[length++] = ';';
+            }
+            if (length > 0) {
+                joined[length++] = ' ';
+            }
+            while (c[1] == ' ' || c[1] == '\t') {
+                c++;
+            }
+            wordStart = true;
+        } else {
+            joined[length++] = *c;
+            wordStart = strchr(wordEnds, *c) != NULL;
+        }
+    }
+    while (length > 0 && strchr(" \t\r;", joined[length - 1]) != NULL) {
+        length--;
+    }
+    if (length + 2 > MAX_INPUT_SIZE) {
+        return false;
+    }
+    memcpy(historyLine, joined, length);
+    strcpy(historyLine + length, "\n");
+    return true;
+}
+
+/*
+ *  Reads lines until the block that starts with input is complete, then runs it
+ *  A block of several lines is put in historyLine joined into one line
+ *  Returns false if the block cannot be saved to history
+ */
+bool runScriptBlock(char *input, historyCommand *history, char *historyLine) {
+    char text[MAX_SCRIPT_SIZE];
+    char line[MAX_INPUT_SIZE];
+    snprintf(text, sizeof(text), "%s", input);
+    snprintf(historyLine, MAX_INPUT_SIZE, "%s", input);
+    bool saved = true;
+
+    while (true) {
+        parseStatus status;
+        compiledScript *script = getCompiledText(text, &status);
+        if (status != PARSE_INCOMPLETE) {
+            if (strcmp(text, input) != 0 && !joinScriptLines(text, historyLine)) {
+                printf("Block too long to save to history\n");
+                saved = false;
+            }
+            if (status == PARSE_OK) {
+                runCompiledScript(script, history);
+            } else {
+                lastExitStatus = 2;
+            }
+            return saved;
+        }
+        printf("... ");
+        if (fgets(line, MAX_INPUT_SIZE, stdin) == NULL) {
+            printf("\nSyntax error: unexpected end of input\n");
+            lastExitStatus = 2;
+            return false;
+        }
+        if (strlen(text) + strlen(line) >= MAX_SCRIPT_SIZE) {
+            printf("Script too long\n");
+            lastExitStatus = 2;
+            return false;
+        }
+        strcat(text, line);
+    }
+}
+
+/*
+ *  Runs a complete script given as text, such as a command from history
+ */
+void runScriptText(char *text, historyCommand *history) {
+    parseStatus status;
+    compiledScript *script = getCompiledText(text, &status);
+    if (status == PARSE_INCOMPLETE) {
+        printf("Syntax error: unexpected end of input\n");
+    }
+    if (script == NULL) {
+        lastExitStatus = 2;
+        return;
+    }
+    runCompiledScript(script, history);
+}
+
+/*
+ *  Reads the whole file into a string
+ *  Caller must free the pointer
+ */
+static char *readScriptFile(char *filename, long long size) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    char *text = malloc(size + 1);
+    size_t length = fread(text, 1, size, file);
+    text[length] = '\0';
+    fclose(file);
+    return text;
+}
+
+/*
+ *  Runs the script in a file with the remaining arguments as its parameters
+ *  The compiled script is reused until the file changes
+ */
+void sourceCommand(char **arguments, historyCommand *history) {
+    if (arguments[1] == NULL) {
+        printf("source requires a filename\n");
+        lastExitStatus = 1;
+        return;
+    }
+    struct stat info;
+    char fullPath[PATH_MAX];
+    if (stat(arguments[1], &info) < 0 || realpath(arguments[1], fullPath) == NULL) {
+        perror(arguments[1]);
+        lastExitStatus = 1;
+        return;
+    }
+
+    char key[PATH_MAX + 8];
+    snprintf(key, sizeof(key), "file:%s", fullPath);
+    long long modified = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+    parseStatus status;
+    compiledScript *script = getCompiledScript(key, NULL, info.st_size, modified, &status);
+    if (script == NULL) {
+        char *text = readScriptFile(fullPath, info.st_size);
+        if (text == NULL) {
+            perror(arguments[1]);
+            lastExitStatus = 1;
+            return;
+        }
+        script = getCompiledScript(key, text, info.st_size, modified, &status);
+        free(text);
+    }
+    if (status == PARSE_INCOMPLETE) {
+        printf("Syntax error: unexpected end of file in %s\n", arguments[1]);
+    }
+    if (script == NULL) {
+        lastExitStatus = 2;
+        return;
+    }
+
+    char **savedPositional = positional;
+    int savedPositionalCount = positionalCount;
+    positional = arguments + 2;
+    positionalCount = 0;
+    while (positional[positionalCount] != NULL) {
+        positionalCount++;
+    }
+    runCompiledScript(script, history);
+    positional = savedPositional;
+    positionalCount = savedPositionalCount;
+}
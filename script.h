@@ -0,0 +1,97 @@
+#pragma once
+#include "common.h"
+#include "history.h"
+
+#define MAX_SCRIPT_SIZE 8192
+#define MAX_SCRIPT_ARGUMENTS 50
+#define MAX_CACHED_SCRIPTS 16
+#define MAX_FUNCTIONS 32
+#define MAX_CALL_DEPTH 100
+#define MAX_VARIABLES 64
+
+enum tokenType {
+    TOKEN_WORD,
+    TOKEN_SEPARATOR,
+    TOKEN_OPEN_PAREN,
+    TOKEN_CLOSE_PAREN,
+    TOKEN_END
+} typedef tokenType;
+
+struct scriptToken {
+    tokenType type;
+    char *text;
+} typedef scriptToken;
+
+enum parseStatus {
+    PARSE_OK,
+    PARSE_INCOMPLETE,
+    PARSE_ERROR
+} typedef parseStatus;
+
+struct scriptParser {
+    scriptToken *tokens;
+    int position;
+    parseStatus status;
+} typedef scriptParser;
+
+enum nodeType {
+    NODE_COMMAND,
+    NODE_LIST,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_FOR,
+    NODE_FUNCTION
+} typedef nodeType;
+
+//Words are split once when compiling, only words containing $ are expanded when run
+struct scriptNode {
+    nodeType type;
+    char **words;
+    bool *needsExpansion;
+    int wordCount;
+    bool isAssignment;
+    bool negate;
+    bool hasList;
+    char *name;
+    struct scriptNode *condition;
+    struct scriptNode *body;
+    struct scriptNode *elseBody;
+    struct scriptNode **children;
+    int childCount;
+} typedef scriptNode;
+
+//Compiled scripts are shared by the cache, the functions they define and
+//any run in progress, and are freed when the last of those lets go
+struct compiledScript {
+    char *key;
+    unsigned long long hash;
+    long long size;
+    long long modified;
+    scriptNode *root;
+    int refCount;
+    unsigned long lastUsed;
+} typedef compiledScript;
+
+//Shell variables stay inside the shell until they are exported
+struct scriptVariable {
+    char name[MAX_INPUT_SIZE];
+    char value[MAX_INPUT_SIZE];
+} typedef scriptVariable;
+
+struct scriptFunction {
+    char name[MAX_INPUT_SIZE];
+    scriptNode *body;
+    compiledScript *owner;
+} typedef scriptFunction;
+
+bool isScriptStart(char *input);
+bool runScriptBlock(char *input, historyCommand *history, char *historyLine);
+void runScriptText(char *text, historyCommand *history);
+void sourceCommand(char **arguments, historyCommand *history);
+void exportCommand(char **arguments);
+bool expandCommandArguments(char **arguments, char *storage, size_t storageSize);
+bool isFunction(char *name);
+void callFunction(char **arguments, historyCommand *history);
+
+//Defined in main.c
+void executeCommand(char **arguments, historyCommand *history);
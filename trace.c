@@ -0,0 +1,128 @@
+#include <time.h>
+
+#include "trace.h"
+
+bool tracingEnabled = false;
+
+static traceEvent traceBuffer[TRACE_BUFFER_SIZE];
+static uint64_t traceWriteIndex = 0;
+
+static const char *phaseNames[TRACE_PHASE_COUNT] = {
+    "input", "alias", "parse", "command", "lookup", "fork", "wait", "history"
+};
+
+/*
+ *  Handles the trace builtin
+ *  trace              prints whether tracing is on and how many spans are recorded
+ *  trace on|off       turns tracing on or off
+ *  trace dump <file>  writes the recorded spans as Chrome trace-event JSON
+ */
+void traceCommand(char **arguments) {
+    if (arguments[1] == NULL) {
+        uint64_t recorded = __atomic_load_n(&traceWriteIndex, __ATOMIC_ACQUIRE);
+        printf("Tracing is %s, %llu spans recorded\n", tracingEnabled ? "on" : "off", (unsigned long long)recorded);
+        return;
+    }
+    if (strcmp(arguments[1], "dump") == 0) {
+        if (arguments[2] == NULL) {
+            printf("trace dump requires a filename\n");
+            return;
+        }
+        if (arguments[3] != NULL) {
+            printf("Too many arguments for trace dump\n");
+            lastExitStatus = 1;
+            return;
+        }
+        dumpTrace(arguments[2]);
+        return;
+    }
+    if (arguments[2] != NULL) {
+        printf("Too many arguments for trace\n");
+        lastExitStatus = 1;
+        return;
+    }
+    if (strcmp(arguments[1], "on") == 0) {
+        tracingEnabled = true;
+    } else if (strcmp(arguments[1], "off") == 0) {
+        tracingEnabled = false;
+    } else {
+        printf("Unknown trace option %s: use on, off or dump\n", arguments[1]);
+        lastExitStatus = 1;
+    }
+}
+
+/*
+ *  Turns tracing on at startup if the trace environment variable is set
+ */
+void initTracing() {
+    char *value = getenv(TRACE_ENV);
+    if (value != NULL && strcmp(value, "") != 0 && strcmp(value, "0") != 0) {
+        tracingEnabled = true;
+    }
+}
+
+/*
+ *  Returns the monotonic clock in nanoseconds
+ */
+uint64_t traceNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ *  Records a span from start until now, overwriting the oldest span once the buffer is full
+ *  Each writer claims its own slot so no lock is needed
+ */
+void recordTraceEvent(tracePhase phase, uint64_t start) {
+    uint64_t end = traceNow();
+    uint64_t index = __atomic_fetch_add(&traceWriteIndex, 1, __ATOMIC_RELAXED);
+    traceEvent *event = &traceBuffer[index & (TRACE_BUFFER_SIZE - 1)];
+
+    //Mark the slot as being written so a dump skips it
+    __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->start = start;
+    event->duration = end - start;
+    event->phase = phase;
+    __atomic_store_n(&event->sequence, (uint32_t)index + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Writes the recorded spans to filename in the Chrome/Perfetto trace-event format
+ */
+void dumpTrace(char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror(filename);
+        return;
+    }
+
+    uint64_t end = __atomic_load_n(&traceWriteIndex, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > TRACE_BUFFER_SIZE ? end - TRACE_BUFFER_SIZE : 0;
+    int pid = getpid();
+    int written = 0;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint64_t i = begin; i < end; i++) {
+        traceEvent *slot = &traceBuffer[i & (TRACE_BUFFER_SIZE - 1)];
+        uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        traceEvent event = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        //Skip slots that were being written or were overwritten while copying
+        if (sequence != (uint32_t)i + 1 || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence
+            || event.phase >= TRACE_PHASE_COUNT) {
+            continue;
+        }
+        //Timestamps are in microseconds, keep the nanoseconds as decimals
+        fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%d}",
+                written == 0 ? "" : ",", phaseNames[event.phase],
+                (unsigned long long)(event.start / 1000), (unsigned long long)(event.start % 1000),
+                (unsigned long long)(event.duration / 1000), (unsigned long long)(event.duration % 1000),
+                pid, pid);
+        written++;
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    printf("Wrote %d spans to %s\n", written, filename);
+}
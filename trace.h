@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include "common.h"
+
+#define TRACE_ENV "SHELL_TRACE"
+//Must be a power of two
+#define TRACE_BUFFER_SIZE 4096
+
+enum tracePhase {
+    TRACE_INPUT,
+    TRACE_ALIAS,
+    TRACE_PARSE,
+    TRACE_COMMAND,
+    TRACE_LOOKUP,
+    TRACE_FORK,
+    TRACE_WAIT,
+    TRACE_HISTORY,
+    TRACE_PHASE_COUNT
+} typedef tracePhase;
+
+struct traceEvent {
+    uint64_t start;
+    uint64_t duration;
+    uint32_t phase;
+    uint32_t sequence;
+} typedef traceEvent;
+
+void traceCommand(char **arguments);
+void initTracing();
+uint64_t traceNow();
+void recordTraceEvent(tracePhase phase, uint64_t start);
+void dumpTrace(char *filename);
+
+extern bool tracingEnabled;
+
+/*
+ *  Starts a span, returning 0 without reading the clock when tracing is off
+ */
+static inline uint64_t traceBegin() {
+    return __builtin_expect(tracingEnabled, 0) ? traceNow() : 0;
+}
+
+/*
+ *  Ends a span started by traceBegin
+ */
+static inline void traceEnd(tracePhase phase, uint64_t start) {
+    if (__builtin_expect(start != 0, 0)) {
+        recordTraceEvent(phase, start);
+    }
+}